@@ -1,22 +1,132 @@
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
+#define _DEFAULT_SOURCE
 
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <math.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#ifdef GLOBE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "globe.h"
+
+// The library exports only the globe.h functions. The commands are still
+// compiled in, unused, for the tests that include this file.
+#ifdef GLOBE_LIBRARY
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
 #define GLOBE_COLS ((size_t)43200)
 #define GLOBE_ROWS ((size_t)21600)
 #define GLOBE_CELLS ((size_t)GLOBE_COLS * GLOBE_ROWS)
-#define MAX_CHUNK_SIZE ((size_t)10800 * 6000)
 #define NUM_CHUNKS ((size_t)16)
+#define MAX_CHUNK_COLS ((size_t)10800)
+#define GLOBE_BLOCK ((size_t)256)
+#define GLOBE_BLOCKS_ACROSS ((GLOBE_COLS + GLOBE_BLOCK - 1) / GLOBE_BLOCK)
+#define GLOBE_BLOCKS_DOWN ((GLOBE_ROWS + GLOBE_BLOCK - 1) / GLOBE_BLOCK)
+#define GLOBE_BLOCKS (GLOBE_BLOCKS_ACROSS * GLOBE_BLOCKS_DOWN)
+#define GLOBE_BLOCK_BYTES (GLOBE_BLOCK * GLOBE_BLOCK * sizeof(int16_t))
+#define GLOBE_MAGIC "GLOBEBIN"
+#define GLOBE_VERSION 1
+#define GLOBE_DTYPE_INT16LE 1
+#define GLOBE_PAGE ((size_t)4096)
+#define BLOCK_GROUP ((size_t)64)
+#define BLOCK_LANES ((size_t)4)
+#define BLOCK_MAX_WIDTH 17
+#define BLOCK_CODEC_MAX                                                        \
+  (1 + GLOBE_BLOCK * GLOBE_BLOCK / BLOCK_GROUP *                               \
+           (2 + BLOCK_GROUP * BLOCK_MAX_WIDTH / 8))
+#define BLOCK_CACHE_SLOTS (4 * GLOBE_BLOCKS_ACROSS)
+#define MAX_THREADS ((size_t)256)
 #define NO_DATA -500
-#define CELL_DEG 0.008333
+#define CELL_DEG (360.0 / GLOBE_COLS)
+#define MAX_READ_GAP ((size_t)64 * 1024)
+#define MAX_READ_SPAN ((size_t)8 * 1024 * 1024)
+#define STATS_BLOCK ((size_t)8192)
+#define PALETTE_SIZE ((size_t)65536)
+#define ADLER_BASE 65521u
+#define ADLER_NMAX ((size_t)5552)
+#define DEFLATE_WINDOW ((size_t)32768)
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_HASH_SIZE ((size_t)1 << DEFLATE_HASH_BITS)
+#define PNG_STRIP_BYTES ((size_t)1024 * 1024)
+#define PNG_LEVEL 8
+#define RENDER_SCRATCH_CELLS ((size_t)4 * 1024 * 1024)
+#define OVERVIEW_MAGIC "GLOBEOVR"
+#define OVERVIEW_MAX_LEVELS 16
+#define OVERVIEW_MIN_COLS ((size_t)256)
+#define OVERVIEW_PLANES 3
+#define TILE_SIZE ((size_t)256)
+#define TILE_CELLS (TILE_SIZE * TILE_SIZE)
+#define TILES_MAX_ZOOM 10
+#define TILES_TASK_ZOOM 3
+#define TILES_DEFAULT_ZOOM 5
+#define COORD_STR_LEN 16
+#define CSV_LINE_MAX (2 * COORD_STR_LEN + 8)
+#define CSV_ROW_MAX (GLOBE_COLS * CSV_LINE_MAX)
+#define CSV_BUF_SIZE ((size_t)8 * 1024 * 1024)
+#define QUERY_BATCH 4096
+#define SERVE_PORT 8080
+#define SERVE_CACHE_MB 64
+#define SERVE_REQUEST_MAX 8192
+#define SERVE_MAX_EVENTS 64
+#define SERVE_SEND_TIMEOUT_MS 10000
+#define SERVE_PATH_MAX 256
+#define SERVE_DEFAULT_SAMPLES 100
+#define SERVE_MAX_SAMPLES 10000
+#define TILE_CACHE_BUCKETS 4096
+#define EARTH_RADIUS_M 6371008.8
+#define HILLSHADE_AZIMUTH 315.0
+#define HILLSHADE_ALTITUDE 45.0
+#define HILLSHADE_BLEND_MAX 1.5
+#define SURFACE_STRIP_ROWS ((size_t)64)
+#define ASPECT_FLAT -1.0f
+#define CONTOUR_BAND_ROWS ((size_t)256)
+#define CONTOUR_TILE_COLS ((size_t)256)
+#define CONTOUR_MAGIC "GLOBECTR"
+#define CELL_RECORD_SIZE 6
+#define POINT_RECORD_SIZE 10
+#define THRIFT_MAX_DEPTH 8
+#define THRIFT_I32 5
+#define THRIFT_I64 6
+#define THRIFT_BINARY 8
+#define THRIFT_LIST 9
+#define THRIFT_STRUCT 12
+#define PARQUET_MAGIC "PAR1"
+#define PARQUET_NUM_COLUMNS ((size_t)3)
+#define PARQUET_PAGE_VALUES ((size_t)128 * 1024)
+#define PARQUET_ROW_GROUP_SIZE ((size_t)1024 * 1024)
+#define PARQUET_INT32 1
+#define PARQUET_DOUBLE 5
+#define PARQUET_REQUIRED 0
+#define PARQUET_INT_16 16
+#define PARQUET_PLAIN 0
+#define PARQUET_RLE 3
+#define PARQUET_UNCOMPRESSED 0
+#define PARQUET_DATA_PAGE 0
 
 struct Chunk {
   char name[11];
@@ -26,18 +136,161 @@ struct Chunk {
   size_t col_offset;
 };
 
+// Shards of the GLOBE dataset and where they sit in the global array.
+static const struct Chunk CHUNKS[NUM_CHUNKS] = {
+    {"all10/a11g", 10800, 4800, 0, 0},
+    {"all10/b10g", 10800, 4800, 0, 10800},
+    {"all10/c10g", 10800, 4800, 0, 10800 * 2},
+    {"all10/d10g", 10800, 4800, 0, 10800 * 3},
+    {"all10/e10g", 10800, 6000, 4800, 0},
+    {"all10/f10g", 10800, 6000, 4800, 10800},
+    {"all10/g10g", 10800, 6000, 4800, 10800 * 2},
+    {"all10/h10g", 10800, 6000, 4800, 10800 * 3},
+    {"all10/i10g", 10800, 6000, 4800 + 6000, 0},
+    {"all10/j10g", 10800, 6000, 4800 + 6000, 10800},
+    {"all10/k10g", 10800, 6000, 4800 + 6000, 10800 * 2},
+    {"all10/l10g", 10800, 6000, 4800 + 6000, 10800 * 3},
+    {"all10/m10g", 10800, 4800, 4800 + 6000 + 6000, 0},
+    {"all10/n10g", 10800, 4800, 4800 + 6000 + 6000, 10800},
+    {"all10/o10g", 10800, 4800, 4800 + 6000 + 6000, 10800 * 2},
+    {"all10/p10g", 10800, 4800, 4800 + 6000 + 6000, 10800 * 3}};
+
+// Summary of a run of cells. min, max and sum only cover cells that aren't
+// NO_DATA, which are counted separately.
+struct Stats {
+  size_t count;
+  size_t nodata;
+  int64_t sum;
+  int16_t min;
+  int16_t max;
+};
+
+#define STATS_INIT {0, 0, 0, INT16_MAX, INT16_MIN}
+
 enum RGBMode { TERRAIN, GREYSCALE };
 
-void print_help() {
+// Render shading: none, grey hillshade, or hillshade blended into the
+// palette colors.
+enum Shading { SHADE_NONE, SHADE_HILLSHADE, SHADE_BLEND };
+
+// Terrain derivatives written by slope and aspect, and their sample types.
+enum Surface { SURFACE_SLOPE, SURFACE_ASPECT };
+enum RasterType { RASTER_FLOAT32, RASTER_UINT8 };
+
+// Output formats of table.
+enum TableFormat { TABLE_CSV, TABLE_CELLS, TABLE_POINTS };
+
+// Which point of a cell its coordinates refer to.
+enum CellAnchor { CELL_CORNER, CELL_CENTER };
+
+// Cell window [minx, maxx) x [miny, maxy) of the globe.
+struct Window {
+  size_t minx;
+  size_t miny;
+  size_t maxx;
+  size_t maxy;
+};
+
+// How a compressed block is stored, its first byte.
+enum BlockCodec { CODEC_RAW, CODEC_PACKED };
+
+// Header of globe.bin, describing the grid and how its cells are stored. It
+// is followed by the index of block offsets, whose last entry is the end of
+// the last block, so block b is index[b + 1] - index[b] bytes long, and by
+// the CRC-32C of every block. Row-major files have no index, but the space
+// is kept so cells always start on the page at GLOBE_DATA_OFFSET. crc covers
+// everything before that offset, with crc itself set to zero. Files without
+// a header are row-major arrays of GLOBE_CELLS int16 values.
+struct GlobeHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t data_offset;
+  uint32_t cols;
+  uint32_t rows;
+  double west;
+  double north;
+  double cell_deg;
+  int32_t nodata;
+  uint32_t dtype;
+  uint32_t layout;
+  uint32_t block_size;
+  uint32_t blocks_across;
+  uint32_t blocks_down;
+  uint64_t data_size;
+  uint32_t crc;
+  uint32_t reserved;
+};
+
+#define GLOBE_INDEX_SIZE ((GLOBE_BLOCKS + 1) * sizeof(uint64_t))
+#define GLOBE_DATA_OFFSET                                                      \
+  ((sizeof(struct GlobeHeader) + GLOBE_INDEX_SIZE +                            \
+    GLOBE_BLOCKS * sizeof(uint32_t) + GLOBE_PAGE - 1) /                        \
+   GLOBE_PAGE * GLOBE_PAGE)
+
+// Decoded blocks of a compressed globe, shared by all threads. where maps a
+// block to the slot holding it, or -1. Slots are allocated as they are first
+// needed, and once there are BLOCK_CACHE_SLOTS the least recently used one
+// that no reader has pinned is reused.
+struct BlockSlot {
+  size_t block;
+  int pins;
+  int loading;
+  uint64_t used;
+  int16_t *cells;
+};
+
+struct BlockCache {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint64_t clock;
+  size_t num_slots;
+  int32_t where[GLOBE_BLOCKS];
+  struct BlockSlot slots[BLOCK_CACHE_SLOTS];
+};
+
+// Whether each block was checked against its checksum. The first thread to
+// read a block checks it while the others wait on done.
+enum BlockCheck { BLOCK_UNCHECKED, BLOCK_CHECKING, BLOCK_VALID, BLOCK_CORRUPT };
+
+struct BlockChecks {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  uint8_t state[GLOBE_BLOCKS];
+};
+
+static void print_help() {
   printf("Usage:\n");
-  printf("globe merge -o ./globe.bin;\n");
-  printf("globe table -i ./globe.bin -o globe.csv;\n");
+  printf("globe merge -o ./globe.bin --threads=4;\n");
+  printf("globe merge -o ./globe.bin --layout=tiled;\n");
+  printf("globe merge -o ./globe.bin --layout=compressed;\n");
+  printf("globe stats -i ./globe.bin;\n");
+  printf("globe table -i ./globe.bin -o globe.csv --threads=4;\n");
+  printf("globe table -i ./globe.bin -o alps.bin --format=points "
+         "--min-elev=2000 --minlon=5 --minlat=44 --maxlon=16 --maxlat=48;\n");
+  printf("globe parquet -i ./globe.bin -o globe.parquet;\n");
   printf("globe render -i ./globe.bin -o globe.png --minlon=-180 --minlat=0 "
-         "--maxlon=0 --maxlat=90;\n");
+         "--maxlon=0 --maxlat=90 --png-level=6;\n");
+  printf("globe overviews -i ./globe.bin;\n");
+  printf("globe render -i ./globe.bin -o world.png --minlon=-180 --minlat=-90 "
+         "--maxlon=180 --maxlat=90 --width=1000 --resample=bilinear;\n");
+  printf("globe render -i ./globe.bin -o alps.png --minlon=5 --minlat=44 "
+         "--maxlon=16 --maxlat=48 --shade=blend --azimuth=315 "
+         "--altitude=45;\n");
+  printf("globe tiles -i ./globe.bin -o ./tiles --max-zoom=6;\n");
+  printf("globe slope -i ./globe.bin -o slope.bin --dtype=uint8;\n");
+  printf("globe aspect -i ./globe.bin -o alps_aspect.bin --minlon=5 "
+         "--minlat=44 --maxlon=16 --maxlat=48;\n");
+  printf("globe contour -i ./globe.bin -o contours.geojson --interval=100;\n");
+  printf("globe contour -i ./globe.bin -o alps.ctr --interval=50 --binary "
+         "--min-elev=1000 --minlon=5 --minlat=44 --maxlon=16 --maxlat=48;\n");
+  printf("globe query -i ./globe.bin --lon=86.925 --lat=27.988;\n");
+  printf("globe query -i ./globe.bin --points=points.csv -o elev.csv "
+         "--resample=bilinear;\n");
+  printf("globe serve -i ./globe.bin --port=8080 --cache-mb=64;\n");
 }
 
-void elev_to_rgb(int16_t value, uint8_t *r, uint8_t *g, uint8_t *b,
-                 enum RGBMode rmode) {
+static void elev_to_rgb(int16_t value, uint8_t *r, uint8_t *g, uint8_t *b,
+                        enum RGBMode rmode) {
   uint8_t gray;
   switch (rmode) {
   case TERRAIN:
@@ -84,293 +337,5796 @@ void elev_to_rgb(int16_t value, uint8_t *r, uint8_t *g, uint8_t *b,
   }
 }
 
-int merge(char *out_file) {
-  struct Chunk chunks[NUM_CHUNKS] = {
-      {"all10/a11g", 10800, 4800, 0, 0},
-      {"all10/b10g", 10800, 4800, 0, 10800},
-      {"all10/c10g", 10800, 4800, 0, 10800 * 2},
-      {"all10/d10g", 10800, 4800, 0, 10800 * 3},
-      {"all10/e10g", 10800, 6000, 4800, 0},
-      {"all10/f10g", 10800, 6000, 4800, 10800},
-      {"all10/g10g", 10800, 6000, 4800, 10800 * 2},
-      {"all10/h10g", 10800, 6000, 4800, 10800 * 3},
-      {"all10/i10g", 10800, 6000, 4800 + 6000, 0},
-      {"all10/j10g", 10800, 6000, 4800 + 6000, 10800},
-      {"all10/k10g", 10800, 6000, 4800 + 6000, 10800 * 2},
-      {"all10/l10g", 10800, 6000, 4800 + 6000, 10800 * 3},
-      {"all10/m10g", 10800, 4800, 4800 + 6000 + 6000, 0},
-      {"all10/n10g", 10800, 4800, 4800 + 6000 + 6000, 10800},
-      {"all10/o10g", 10800, 4800, 4800 + 6000 + 6000, 10800 * 2},
-      {"all10/p10g", 10800, 4800, 4800 + 6000 + 6000, 10800 * 3}};
+// Build the color of every int16 value, NO_DATA included, so rendering is a
+// table lookup per pixel. Entries are RGB plus a pad byte, which lets
+// colorize_row store whole words.
+static uint32_t *palette_init(enum RGBMode rmode) {
+  uint32_t *palette = malloc(PALETTE_SIZE * sizeof(uint32_t));
+  if (palette == NULL) {
+    perror("palette malloc");
+    return NULL;
+  }
+  for (int32_t value = INT16_MIN; value <= INT16_MAX; value++) {
+    uint8_t rgb[4] = {30, 40, 80, 0};
+    if (value != NO_DATA)
+      elev_to_rgb((int16_t)value, &rgb[0], &rgb[1], &rgb[2], rmode);
+    memcpy(&palette[(uint16_t)value], rgb, sizeof(rgb));
+  }
+  return palette;
+}
+
+// Convert n cells to RGB. Each pixel is stored as a 4 byte word, the pad byte
+// being overwritten by the next pixel, except for the last one.
+static void colorize_row(const uint32_t *palette, const int16_t *src, size_t n,
+                         uint8_t *dst) {
+  if (n == 0)
+    return;
+  for (size_t i = 0; i + 1 < n; i++)
+    memcpy(dst + i * 3, &palette[(uint16_t)src[i]], sizeof(uint32_t));
+  memcpy(dst + (n - 1) * 3, &palette[(uint16_t)src[n - 1]], 3);
+}
+
+// pread until len bytes are read. Hitting end of file is an error.
+static int pread_full(int fd, void *buf, size_t len, off_t offset) {
+  uint8_t *p = buf;
+  while (len > 0) {
+    ssize_t n = pread(fd, p, len, offset);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1) {
+      perror("pread");
+      return 1;
+    }
+    if (n == 0) {
+      fprintf(stderr, "pread: unexpected end of file.\n");
+      return 1;
+    }
+    p += n;
+    len -= (size_t)n;
+    offset += n;
+  }
+  return 0;
+}
+
+// pwrite until len bytes are written.
+static int pwrite_full(int fd, const void *buf, size_t len, off_t offset) {
+  const uint8_t *p = buf;
+  while (len > 0) {
+    ssize_t n = pwrite(fd, p, len, offset);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1) {
+      perror("pwrite");
+      return 1;
+    }
+    p += n;
+    len -= (size_t)n;
+    offset += n;
+  }
+  return 0;
+}
+
+// CRC-32 of PNG chunks and CRC-32C of globe.bin blocks, slicing by 8:
+// table[k][n] is the CRC of byte n followed by k zero bytes, so 8 bytes are
+// folded in per step with 8 independent lookups instead of a chain of 8
+// dependent ones.
+static uint32_t crc_table[8][256];
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+static pthread_once_t crc32c_table_once = PTHREAD_ONCE_INIT;
+
+static void crc_table_build(uint32_t poly, uint32_t table[8][256]) {
+  for (uint32_t n = 0; n < 256; n++) {
+    uint32_t c = n;
+    for (int k = 0; k < 8; k++)
+      c = c & 1 ? poly ^ (c >> 1) : c >> 1;
+    table[0][n] = c;
+  }
+  for (uint32_t n = 0; n < 256; n++)
+    for (int k = 1; k < 8; k++)
+      table[k][n] = table[0][table[k - 1][n] & 0xff] ^ (table[k - 1][n] >> 8);
+}
+
+static void crc_table_init(void) { crc_table_build(0xedb88320, crc_table); }
+
+static void crc32c_table_init(void) {
+  crc_table_build(0x82f63b78, crc32c_table);
+}
+
+static uint32_t crc_slice8(uint32_t table[8][256], uint32_t crc,
+                           const uint8_t *buf, size_t len) {
+  crc = ~crc;
+  for (; len >= 8; len -= 8, buf += 8) {
+    uint32_t lo = crc ^ ((uint32_t)buf[0] | (uint32_t)buf[1] << 8 |
+                         (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24);
+    crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+          table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+          table[3][buf[4]] ^ table[2][buf[5]] ^ table[1][buf[6]] ^
+          table[0][buf[7]];
+  }
+  while (len--)
+    crc = table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+static uint32_t crc_update(uint32_t crc, const uint8_t *buf, size_t len) {
+  pthread_once(&crc_table_once, crc_table_init);
+  return crc_slice8(crc_table, crc, buf, len);
+}
+
+#ifdef __x86_64__
+static __attribute__((target("sse4.2"))) uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *buf, size_t len) {
+  uint64_t c = ~crc;
+  for (; len >= 8; len -= 8, buf += 8) {
+    uint64_t word;
+    memcpy(&word, buf, sizeof(word));
+    c = _mm_crc32_u64(c, word);
+  }
+  while (len--)
+    c = _mm_crc32_u8((uint32_t)c, *buf++);
+  return ~(uint32_t)c;
+}
+#endif
+
+// CRC-32C, with the crc32 instruction when the CPU has it.
+static uint32_t crc32c_update(uint32_t crc, const uint8_t *buf, size_t len) {
+#ifdef __x86_64__
+  if (__builtin_cpu_supports("sse4.2"))
+    return crc32c_sse42(crc, buf, len);
+#endif
+  pthread_once(&crc32c_table_once, crc32c_table_init);
+  return crc_slice8(crc32c_table, crc, buf, len);
+}
+
+// The row above the first row of a block. With zeros above, the MED
+// predictor reduces to the left neighbour.
+static const int16_t BLOCK_ZERO_ROW[GLOBE_BLOCK];
+
+// Prediction of cell x of a block row from its neighbours, the median edge
+// detector of LOCO-I: the median of left, up and left + up - up-left.
+static int block_predict(const int16_t *row, const int16_t *up, size_t x) {
+  if (x == 0)
+    return up[0];
+  int a = row[x - 1];
+  int b = up[x];
+  int c = a + b - up[x - 1];
+  int hi = a > b ? a : b;
+  int lo = a < b ? a : b;
+  return c > hi ? hi : c < lo ? lo : c;
+}
+
+// Map a residual to a small unsigned value, and back.
+static uint32_t zigzag(int32_t r) {
+  return ((uint32_t)r << 1) ^ (uint32_t)(r >> 31);
+}
+
+static int32_t unzigzag(uint32_t z) {
+  return (int32_t)(z >> 1) ^ -(int32_t)(z & 1);
+}
+
+// Pack BLOCK_GROUP residuals into out as a width byte, an exception count,
+// the low width bits of every residual and then, for each residual that
+// doesn't fit, its position and high 16 bits. The width is picked to
+// minimize the size, so a coastline jump doesn't widen the whole group.
+// Returns the number of bytes written.
+static size_t block_pack(const uint32_t *res, uint8_t *out) {
+  size_t count[BLOCK_MAX_WIDTH + 1] = {0};
+  for (size_t i = 0; i < BLOCK_GROUP; i++)
+    count[res[i] ? 32 - __builtin_clz(res[i]) : 0]++;
+  int max = BLOCK_MAX_WIDTH;
+  while (max > 0 && count[max] == 0)
+    max--;
+  int width = max;
+  size_t best = BLOCK_GROUP * (size_t)max / 8;
+  size_t wider = 0;
+  for (int w = max - 1; w >= 0 && w >= max - 16; w--) {
+    wider += count[w + 1];
+    size_t size = BLOCK_GROUP * (size_t)w / 8 + 3 * wider;
+    if (size < best) {
+      best = size;
+      width = w;
+    }
+  }
+
+  uint8_t *p = out + 2;
+  uint64_t bits = 0;
+  int n = 0;
+  for (size_t i = 0; i < BLOCK_GROUP; i++) {
+    bits |= (uint64_t)(res[i] & ((1u << width) - 1)) << n;
+    for (n += width; n >= 8; n -= 8) {
+      *p++ = (uint8_t)bits;
+      bits >>= 8;
+    }
+  }
+  out[0] = (uint8_t)width;
+  out[1] = 0;
+  for (size_t i = 0; i < BLOCK_GROUP; i++) {
+    uint32_t high = res[i] >> width;
+    if (high == 0)
+      continue;
+    out[1]++;
+    *p++ = (uint8_t)i;
+    *p++ = (uint8_t)high;
+    *p++ = (uint8_t)(high >> 8);
+  }
+  return (size_t)(p - out);
+}
+
+// Unpack a group written by block_pack from the len bytes at in into res.
+// Returns the number of bytes read, or 0 if the group is malformed.
+static size_t block_unpack(const uint8_t *in, size_t len, uint32_t *res) {
+  if (len < 2 || in[0] > BLOCK_MAX_WIDTH)
+    return 0;
+  int width = in[0];
+  size_t size = 2 + BLOCK_GROUP * (size_t)width / 8 + 3 * (size_t)in[1];
+  if (len < size)
+    return 0;
+  const uint8_t *p = in + 2;
+  uint32_t mask = (1u << width) - 1;
+  if (len >= size + sizeof(uint64_t)) {
+    // Load each value with an unaligned word read, which may run past the
+    // group but not past the block.
+    for (size_t i = 0; i < BLOCK_GROUP; i++) {
+      size_t bit = i * (size_t)width;
+      uint64_t word;
+      memcpy(&word, p + bit / 8, sizeof(word));
+      res[i] = (uint32_t)(word >> bit % 8) & mask;
+    }
+    p += BLOCK_GROUP * (size_t)width / 8;
+  } else {
+    uint64_t bits = 0;
+    int n = 0;
+    for (size_t i = 0; i < BLOCK_GROUP; i++) {
+      for (; n < width; n += 8)
+        bits |= (uint64_t)*p++ << n;
+      res[i] = (uint32_t)bits & mask;
+      bits >>= width;
+      n -= width;
+    }
+  }
+  for (size_t e = 0; e < in[1]; e++, p += 3) {
+    if (p[0] >= BLOCK_GROUP)
+      return 0;
+    res[p[0]] |= (uint32_t)(p[1] | p[2] << 8) << width;
+  }
+  return size;
+}
+
+// Rebuild BLOCK_LANES block rows from their residuals, the inverse of
+// block_predict. Each row only depends on the one above up to the next
+// column, so the rows are decoded side by side, which hides the latency of
+// the predictor.
+static void block_unpredict(const uint32_t *res, const int16_t *up,
+                            int16_t *rows) {
+  int left[BLOCK_LANES];
+  const int16_t *above = up;
+  for (size_t k = 0; k < BLOCK_LANES; k++) {
+    int16_t *row = rows + k * GLOBE_BLOCK;
+    left[k] = (int16_t)(above[0] + unzigzag(res[k * GLOBE_BLOCK]));
+    row[0] = (int16_t)left[k];
+    above = row;
+  }
+  for (size_t x = 1; x < GLOBE_BLOCK; x++) {
+    above = up;
+    for (size_t k = 0; k < BLOCK_LANES; k++) {
+      int16_t *row = rows + k * GLOBE_BLOCK;
+      int a = left[k];
+      int b = above[x];
+      int c = a + b - above[x - 1];
+      int hi = a > b ? a : b;
+      int lo = a < b ? a : b;
+      int pred = c > hi ? hi : c < lo ? lo : c;
+      left[k] = (int16_t)(pred + unzigzag(res[k * GLOBE_BLOCK + x]));
+      row[x] = (int16_t)left[k];
+      above = row;
+    }
+  }
+}
+
+// Encode a block into out, which must hold BLOCK_CODEC_MAX bytes, and return
+// the encoded length. MED prediction residuals are zigzag encoded and packed
+// by block_pack. Blocks that don't shrink are stored as they are.
+static size_t block_encode(const int16_t *cells, uint8_t *out) {
+  uint8_t *p = out;
+  uint32_t res[GLOBE_BLOCK];
+  *p++ = CODEC_PACKED;
+  for (size_t y = 0; y < GLOBE_BLOCK; y++) {
+    const int16_t *row = cells + y * GLOBE_BLOCK;
+    const int16_t *up = y ? row - GLOBE_BLOCK : BLOCK_ZERO_ROW;
+    for (size_t x = 0; x < GLOBE_BLOCK; x++)
+      res[x] = zigzag(row[x] - block_predict(row, up, x));
+    for (size_t g = 0; g < GLOBE_BLOCK; g += BLOCK_GROUP)
+      p += block_pack(res + g, p);
+  }
+  if ((size_t)(p - out) > GLOBE_BLOCK_BYTES) {
+    out[0] = CODEC_RAW;
+    memcpy(out + 1, cells, GLOBE_BLOCK_BYTES);
+    return 1 + GLOBE_BLOCK_BYTES;
+  }
+  return (size_t)(p - out);
+}
+
+// Decode the len bytes of a block written by block_encode into cells.
+// Returns 1 if the data is malformed.
+static int block_decode(const uint8_t *in, size_t len, int16_t *cells) {
+  if (len == 1 + GLOBE_BLOCK_BYTES && in[0] == CODEC_RAW) {
+    memcpy(cells, in + 1, GLOBE_BLOCK_BYTES);
+    return 0;
+  }
+  if (len == 0 || in[0] != CODEC_PACKED)
+    return 1;
+  size_t pos = 1;
+  uint32_t res[BLOCK_LANES * GLOBE_BLOCK];
+  for (size_t y = 0; y < GLOBE_BLOCK; y += BLOCK_LANES) {
+    for (size_t g = 0; g < BLOCK_LANES * GLOBE_BLOCK; g += BLOCK_GROUP) {
+      size_t n = block_unpack(in + pos, len - pos, res + g);
+      if (n == 0)
+        return 1;
+      pos += n;
+    }
+    int16_t *rows = cells + y * GLOBE_BLOCK;
+    block_unpredict(res, y ? rows - GLOBE_BLOCK : BLOCK_ZERO_ROW, rows);
+  }
+  return pos == len ? 0 : 1;
+}
+
+void globe_close(struct Globe *globe) {
+  if (globe->cache != NULL) {
+    for (size_t s = 0; s < globe->cache->num_slots; s++)
+      free(globe->cache->slots[s].cells);
+    pthread_mutex_destroy(&globe->cache->lock);
+    pthread_cond_destroy(&globe->cache->cond);
+    free(globe->cache);
+  }
+  if (globe->checks != NULL) {
+    pthread_mutex_destroy(&globe->checks->lock);
+    pthread_cond_destroy(&globe->checks->done);
+    free(globe->checks);
+  }
+  if (globe->data != NULL)
+    munmap((void *)globe->data, globe->size);
+  if (globe->fd != -1)
+    close(globe->fd);
+  globe->fd = -1;
+  globe->size = 0;
+  globe->data = NULL;
+  globe->checks = NULL;
+  globe->cache = NULL;
+}
+
+// Check the header of a mapped globe.bin against the grid this build reads,
+// its checksum, and that every block lies inside the file. Only the header
+// and index are read, the blocks are checked as they are used.
+static int globe_check_header(struct Globe *globe, const char *in_file) {
+  struct GlobeHeader header;
+  const uint8_t *meta = (const uint8_t *)globe->data;
+  memcpy(&header, meta, sizeof(header));
+  if (header.version == 0 || header.version > GLOBE_VERSION) {
+    fprintf(stderr, "%s: unsupported version %u.\n", in_file,
+            header.version);
+    return 1;
+  }
+  if (globe->size < GLOBE_DATA_OFFSET) {
+    fprintf(stderr, "%s is truncated: the header is incomplete.\n", in_file);
+    return 1;
+  }
+  uint32_t crc = header.crc;
+  header.crc = 0;
+  uint32_t actual = crc32c_update(0, (const uint8_t *)&header, sizeof(header));
+  actual = crc32c_update(actual, meta + sizeof(header),
+                         GLOBE_DATA_OFFSET - sizeof(header));
+  if (actual != crc) {
+    fprintf(stderr, "%s: header checksum mismatch.\n", in_file);
+    return 1;
+  }
+  if (header.cols != GLOBE_COLS || header.rows != GLOBE_ROWS ||
+      header.west != -180.0 || header.north != 90.0 ||
+      header.cell_deg != CELL_DEG || header.nodata != NO_DATA ||
+      header.dtype != GLOBE_DTYPE_INT16LE ||
+      header.data_offset != GLOBE_DATA_OFFSET ||
+      header.block_size != GLOBE_BLOCK ||
+      header.blocks_across != GLOBE_BLOCKS_ACROSS ||
+      header.blocks_down != GLOBE_BLOCKS_DOWN ||
+      header.layout > LAYOUT_COMPRESSED) {
+    fprintf(stderr, "%s: unsupported grid or layout.\n", in_file);
+    return 1;
+  }
+  if (header.data_size > globe->size - GLOBE_DATA_OFFSET) {
+    fprintf(stderr, "%s is truncated: expected %zu bytes, found %zu.\n",
+            in_file, (size_t)(GLOBE_DATA_OFFSET + header.data_size),
+            globe->size);
+    return 1;
+  }
+  globe->layout = header.layout;
+  globe->offset = GLOBE_DATA_OFFSET;
+  globe->index = (const uint64_t *)(meta + sizeof(header));
+  globe->checksums =
+      (const uint32_t *)(meta + sizeof(header) + GLOBE_INDEX_SIZE);
+  uint64_t end = GLOBE_DATA_OFFSET + header.data_size;
+  uint64_t expected = GLOBE_CELLS * sizeof(int16_t);
+  if (globe->layout == LAYOUT_TILED)
+    expected = GLOBE_BLOCKS * GLOBE_BLOCK_BYTES;
+  if (globe->layout == LAYOUT_COMPRESSED)
+    expected = globe->index[GLOBE_BLOCKS] - GLOBE_DATA_OFFSET;
+  if (header.data_size != expected) {
+    fprintf(stderr, "%s: data size doesn't match the layout.\n", in_file);
+    return 1;
+  }
+  if (globe->layout == LAYOUT_ROWS)
+    return 0;
+
+  // Check that every block is inside the data.
+  for (size_t b = 0; b < GLOBE_BLOCKS; b++) {
+    uint64_t start = globe->index[b];
+    uint64_t next = globe->layout == LAYOUT_TILED ? start + GLOBE_BLOCK_BYTES
+                                                  : globe->index[b + 1];
+    if (start < GLOBE_DATA_OFFSET || next < start || next > end ||
+        (globe->layout == LAYOUT_TILED && start % sizeof(int16_t) != 0) ||
+        next - start > BLOCK_CODEC_MAX) {
+      fprintf(stderr, "%s: block %zu is out of range.\n", in_file, b);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Map globe.bin read-only. Pages are only read from disk when touched, so
+// callers that only need part of the globe don't pay for the whole file.
+// advice is passed to madvise for the whole mapping.
+int globe_open(struct Globe *globe, char *in_file, int advice) {
+  struct stat st;
+
+  globe->fd = -1;
+  globe->size = 0;
+  globe->data = NULL;
+  globe->layout = LAYOUT_ROWS;
+  globe->offset = 0;
+  globe->index = NULL;
+  globe->checksums = NULL;
+  globe->checks = NULL;
+  globe->cache = NULL;
+
+  // Open file.
+  if ((globe->fd = open(in_file, O_RDONLY)) == -1) {
+    perror("open");
+    return 1;
+  }
+  if (fstat(globe->fd, &st) == -1) {
+    perror("fstat");
+    globe_close(globe);
+    return 1;
+  }
+  globe->size = (size_t)st.st_size;
+
+  // Files with a header start with a magic, bare row-major ones with cells.
+  char magic[sizeof(GLOBE_MAGIC) - 1];
+  int has_header =
+      globe->size >= sizeof(struct GlobeHeader) &&
+      pread_full(globe->fd, magic, sizeof(magic), 0) == 0 &&
+      memcmp(magic, GLOBE_MAGIC, sizeof(magic)) == 0;
+  if (!has_header && globe->size < GLOBE_CELLS * sizeof(int16_t)) {
+    fprintf(stderr, "%s is truncated: expected %zu bytes, found %zu.\n",
+            in_file, GLOBE_CELLS * sizeof(int16_t), globe->size);
+    globe_close(globe);
+    return 1;
+  }
+
+  // Map file.
+  void *data = mmap(NULL, globe->size, PROT_READ, MAP_PRIVATE, globe->fd, 0);
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    globe_close(globe);
+    return 1;
+  }
+  if (madvise(data, globe->size, advice) == -1) {
+    perror("madvise");
+  }
+  globe->data = data;
+  if (!has_header)
+    return 0;
+  if (globe_check_header(globe, in_file) != 0) {
+    globe_close(globe);
+    return 1;
+  }
+  struct BlockChecks *checks = malloc(sizeof(*checks));
+  if (checks == NULL) {
+    perror("checks malloc");
+    globe_close(globe);
+    return 1;
+  }
+  pthread_mutex_init(&checks->lock, NULL);
+  pthread_cond_init(&checks->done, NULL);
+  memset(checks->state, BLOCK_UNCHECKED, sizeof(checks->state));
+  globe->checks = checks;
+
+  // Set up the block cache of compressed files.
+  if (globe->layout == LAYOUT_COMPRESSED) {
+    struct BlockCache *cache = malloc(sizeof(*cache));
+    if (cache == NULL) {
+      perror("cache malloc");
+      globe_close(globe);
+      return 1;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->cond, NULL);
+    cache->clock = 0;
+    cache->num_slots = 0;
+    for (size_t b = 0; b < GLOBE_BLOCKS; b++)
+      cache->where[b] = -1;
+    globe->cache = cache;
+  }
+
+  return 0;
+}
+
+// Check block b against its checksum the first time it is read, so opening a
+// file stays cheap and a command only pays for the blocks it touches.
+// Returns 1 on a mismatch. Files without a header have no checksums.
+static int globe_verify(const struct Globe *globe, size_t b) {
+  struct BlockChecks *checks = globe->checks;
+  if (checks == NULL)
+    return 0;
+  uint8_t state = __atomic_load_n(&checks->state[b], __ATOMIC_ACQUIRE);
+  if (state == BLOCK_VALID)
+    return 0;
+
+  // Someone else is checking the block, wait for the verdict.
+  state = BLOCK_UNCHECKED;
+  if (!__atomic_compare_exchange_n(&checks->state[b], &state, BLOCK_CHECKING,
+                                   0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    pthread_mutex_lock(&checks->lock);
+    while ((state = __atomic_load_n(&checks->state[b], __ATOMIC_ACQUIRE)) ==
+           BLOCK_CHECKING)
+      pthread_cond_wait(&checks->done, &checks->lock);
+    pthread_mutex_unlock(&checks->lock);
+    return state != BLOCK_VALID;
+  }
+
+  const uint8_t *data = (const uint8_t *)globe->data;
+  uint32_t crc = 0;
+  if (globe->layout == LAYOUT_ROWS) {
+    size_t x0 = b % GLOBE_BLOCKS_ACROSS * GLOBE_BLOCK;
+    size_t y0 = b / GLOBE_BLOCKS_ACROSS * GLOBE_BLOCK;
+    size_t x1 = x0 + GLOBE_BLOCK < GLOBE_COLS ? x0 + GLOBE_BLOCK : GLOBE_COLS;
+    size_t y1 = y0 + GLOBE_BLOCK < GLOBE_ROWS ? y0 + GLOBE_BLOCK : GLOBE_ROWS;
+    for (size_t y = y0; y < y1; y++)
+      crc = crc32c_update(crc,
+                          data + globe->offset +
+                              (y * GLOBE_COLS + x0) * sizeof(int16_t),
+                          (x1 - x0) * sizeof(int16_t));
+  } else {
+    size_t len = globe->layout == LAYOUT_TILED
+                     ? GLOBE_BLOCK_BYTES
+                     : globe->index[b + 1] - globe->index[b];
+    crc = crc32c_update(0, data + globe->index[b], len);
+  }
+  state = crc == globe->checksums[b] ? BLOCK_VALID : BLOCK_CORRUPT;
+  if (state == BLOCK_CORRUPT)
+    fprintf(stderr, "block %zu: checksum mismatch.\n", b);
+
+  pthread_mutex_lock(&checks->lock);
+  __atomic_store_n(&checks->state[b], state, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&checks->done);
+  pthread_mutex_unlock(&checks->lock);
+  return state != BLOCK_VALID;
+}
+
+// Verify the blocks of a row-major globe that win intersects.
+static int globe_verify_window(const struct Globe *globe, struct Window win) {
+  if (globe->checks == NULL)
+    return 0;
+  for (size_t by = win.miny / GLOBE_BLOCK; by * GLOBE_BLOCK < win.maxy; by++) {
+    for (size_t bx = win.minx / GLOBE_BLOCK; bx * GLOBE_BLOCK < win.maxx;
+         bx++) {
+      if (globe_verify(globe, by * GLOBE_BLOCKS_ACROSS + bx) != 0)
+        return 1;
+    }
+  }
+  return 0;
+}
+
+// Find a free slot, reusing the least recently used unpinned one once the
+// cache is full. Called with the cache locked; returns NULL if every slot
+// is pinned.
+static struct BlockSlot *block_cache_slot(struct BlockCache *cache) {
+  if (cache->num_slots < BLOCK_CACHE_SLOTS) {
+    int16_t *cells = malloc(GLOBE_BLOCK_BYTES);
+    if (cells != NULL) {
+      struct BlockSlot *slot = &cache->slots[cache->num_slots++];
+      slot->block = GLOBE_BLOCKS;
+      slot->pins = 0;
+      slot->loading = 0;
+      slot->cells = cells;
+      return slot;
+    }
+  }
+  struct BlockSlot *lru = NULL;
+  for (size_t s = 0; s < cache->num_slots; s++) {
+    struct BlockSlot *slot = &cache->slots[s];
+    if (slot->pins == 0 && (lru == NULL || slot->used < lru->used))
+      lru = slot;
+  }
+  if (lru != NULL && lru->block < GLOBE_BLOCKS)
+    cache->where[lru->block] = -1;
+  return lru;
+}
+
+// Cells of block (bx, by) of a tiled globe, or NULL if it can't be decoded.
+// Blocks of compressed files are decoded into the cache on first use, outside
+// the lock, so threads reading different blocks decode them in parallel. The
+// block stays pinned until globe_block_put.
+static const int16_t *globe_block_get(const struct Globe *globe, size_t bx,
+                                      size_t by) {
+  size_t b = by * GLOBE_BLOCKS_ACROSS + bx;
+  if (globe->layout == LAYOUT_TILED) {
+    if (globe_verify(globe, b) != 0)
+      return NULL;
+    return (const int16_t *)((const uint8_t *)globe->data + globe->index[b]);
+  }
+
+  struct BlockCache *cache = globe->cache;
+  struct BlockSlot *slot = NULL;
+  pthread_mutex_lock(&cache->lock);
+  if (cache->where[b] != -1) {
+    slot = &cache->slots[cache->where[b]];
+    slot->pins++;
+    slot->used = ++cache->clock;
+    while (slot->loading)
+      pthread_cond_wait(&cache->cond, &cache->lock);
+  } else {
+    while ((slot = block_cache_slot(cache)) == NULL)
+      pthread_cond_wait(&cache->cond, &cache->lock);
+    slot->block = b;
+    slot->pins = 1;
+    slot->loading = 1;
+    slot->used = ++cache->clock;
+    cache->where[b] = (int32_t)(slot - cache->slots);
+    pthread_mutex_unlock(&cache->lock);
+
+    const uint8_t *in = (const uint8_t *)globe->data + globe->index[b];
+    int failed = globe_verify(globe, b);
+    if (!failed && block_decode(in, globe->index[b + 1] - globe->index[b],
+                                slot->cells) != 0) {
+      fprintf(stderr, "block %zu is corrupt.\n", b);
+      failed = 1;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    slot->loading = 0;
+    if (failed) {
+      cache->where[b] = -1;
+      slot->block = GLOBE_BLOCKS;
+    }
+    pthread_cond_broadcast(&cache->cond);
+  }
+
+  // Readers that waited on a block that failed to decode fail too.
+  if (slot->block != b) {
+    slot->pins--;
+    pthread_cond_broadcast(&cache->cond);
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return slot->cells;
+}
+
+// Release block (bx, by) after globe_block_get.
+static void globe_block_put(const struct Globe *globe, size_t bx, size_t by) {
+  struct BlockCache *cache = globe->cache;
+  if (cache == NULL)
+    return;
+  pthread_mutex_lock(&cache->lock);
+  struct BlockSlot *slot =
+      &cache->slots[cache->where[by * GLOBE_BLOCKS_ACROSS + bx]];
+  if (--slot->pins == 0)
+    pthread_cond_broadcast(&cache->cond);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+// Row y of the globe as a pointer p where p[x] is the cell in column x, for
+// x0 <= x < x1, or NULL if a block can't be decoded. Row-major files are read
+// in place; for tiled ones the cells are gathered from the blocks the row
+// crosses into buf, which must hold GLOBE_COLS cells.
+static const int16_t *globe_row(const struct Globe *globe, size_t y, size_t x0,
+                                size_t x1, int16_t *buf) {
+  if (globe->layout == LAYOUT_ROWS) {
+    struct Window row = {x0, y, x1, y + 1};
+    if (globe_verify_window(globe, row) != 0)
+      return NULL;
+    return (const int16_t *)((const uint8_t *)globe->data + globe->offset) +
+           y * GLOBE_COLS;
+  }
+  size_t by = y / GLOBE_BLOCK;
+  size_t r = y % GLOBE_BLOCK;
+  for (size_t x = x0; x < x1;) {
+    size_t bx = x / GLOBE_BLOCK;
+    size_t end = (bx + 1) * GLOBE_BLOCK < x1 ? (bx + 1) * GLOBE_BLOCK : x1;
+    const int16_t *block = globe_block_get(globe, bx, by);
+    if (block == NULL)
+      return NULL;
+    memcpy(buf + x, block + r * GLOBE_BLOCK + x % GLOBE_BLOCK,
+           (end - x) * sizeof(int16_t));
+    globe_block_put(globe, bx, by);
+    x = end;
+  }
+  return buf;
+}
+
+// Convert a lon/lat bbox to the window of cells it covers.
+static int bbox_to_window(float minlon, float minlat, float maxlon,
+                          float maxlat, struct Window *win) {
+  win->minx = (size_t)round(((minlon + 180) / 360) * GLOBE_COLS);
+  win->miny = (size_t)round(((180 - (maxlat + 90)) / 180) * GLOBE_ROWS);
+  win->maxx = (size_t)round(((maxlon + 180) / 360) * GLOBE_COLS);
+  win->maxy = (size_t)round(((180 - (minlat + 90)) / 180) * GLOBE_ROWS);
+  if (win->minx >= win->maxx || win->miny >= win->maxy ||
+      win->maxx > GLOBE_COLS || win->maxy > GLOBE_ROWS) {
+    return 1;
+  }
+  return 0;
+}
+
+// Read the cells of win from a row-major int16 raster cols wide, stored at
+// base in fd, into out, (maxx - minx) values per row. Each row is a separate
+// span of the file. Rows whose spans are separated by less than MAX_READ_GAP
+// are coalesced into a single pread, so narrow windows and full-width windows
+// both cost a handful of syscalls.
+static int raster_read_window(int fd, off_t base, size_t cols,
+                              struct Window win, int16_t *out) {
+  size_t width = win.maxx - win.minx;
+  size_t gap = (cols - width) * sizeof(int16_t);
+  size_t row_bytes = cols * sizeof(int16_t);
+
+  // Rows too far apart to coalesce, read each one straight into out.
+  if (gap > MAX_READ_GAP) {
+    for (size_t y = win.miny; y < win.maxy; y++) {
+      off_t offset = base + (y * cols + win.minx) * sizeof(int16_t);
+      if (pread_full(fd, out + (y - win.miny) * width,
+                     width * sizeof(int16_t), offset) != 0)
+        return 1;
+    }
+    return 0;
+  }
+
+  // Full-width rows are contiguous, read them straight into out.
+  if (gap == 0) {
+    off_t offset = base + win.miny * row_bytes;
+    return pread_full(fd, out, (win.maxy - win.miny) * row_bytes, offset);
+  }
+
+  // Read runs of rows, gaps included, into a bounce buffer and copy the
+  // window out of it.
+  size_t rows_per_read = MAX_READ_SPAN / row_bytes;
+  if (rows_per_read == 0)
+    rows_per_read = 1;
+  if (rows_per_read > win.maxy - win.miny)
+    rows_per_read = win.maxy - win.miny;
+  uint8_t *span = malloc(rows_per_read * row_bytes);
+  if (span == NULL) {
+    perror("span malloc");
+    return 1;
+  }
+  for (size_t y = win.miny; y < win.maxy; y += rows_per_read) {
+    size_t rows = win.maxy - y < rows_per_read ? win.maxy - y : rows_per_read;
+    off_t offset = base + (y * cols + win.minx) * sizeof(int16_t);
+    size_t len = (rows - 1) * row_bytes + width * sizeof(int16_t);
+    if (pread_full(fd, span, len, offset) != 0) {
+      free(span);
+      return 1;
+    }
+    for (size_t r = 0; r < rows; r++) {
+      memcpy(out + (y - win.miny + r) * width, span + r * row_bytes,
+             width * sizeof(int16_t));
+    }
+  }
+  free(span);
+
+  return 0;
+}
+
+// Read a window of the globe into out. For tiled files only the blocks the
+// window intersects are touched.
+static int globe_read_window(struct Globe *globe, struct Window win,
+                             int16_t *out) {
+  if (globe->layout == LAYOUT_ROWS) {
+    if (globe_verify_window(globe, win) != 0)
+      return 1;
+    return raster_read_window(globe->fd, (off_t)globe->offset, GLOBE_COLS, win,
+                              out);
+  }
+
+  size_t width = win.maxx - win.minx;
+  for (size_t by = win.miny / GLOBE_BLOCK; by * GLOBE_BLOCK < win.maxy; by++) {
+    size_t y0 = by * GLOBE_BLOCK > win.miny ? by * GLOBE_BLOCK : win.miny;
+    size_t y1 = (by + 1) * GLOBE_BLOCK < win.maxy ? (by + 1) * GLOBE_BLOCK
+                                                   : win.maxy;
+    for (size_t bx = win.minx / GLOBE_BLOCK; bx * GLOBE_BLOCK < win.maxx;
+         bx++) {
+      size_t x0 = bx * GLOBE_BLOCK > win.minx ? bx * GLOBE_BLOCK : win.minx;
+      size_t x1 = (bx + 1) * GLOBE_BLOCK < win.maxx ? (bx + 1) * GLOBE_BLOCK
+                                                     : win.maxx;
+      const int16_t *block = globe_block_get(globe, bx, by);
+      if (block == NULL)
+        return 1;
+      for (size_t y = y0; y < y1; y++) {
+        memcpy(out + (y - win.miny) * width + (x0 - win.minx),
+               block + (y % GLOBE_BLOCK) * GLOBE_BLOCK + x0 % GLOBE_BLOCK,
+               (x1 - x0) * sizeof(int16_t));
+      }
+      globe_block_put(globe, bx, by);
+    }
+  }
+  return 0;
+}
+
+static void stats_merge(struct Stats *stats, const struct Stats *part) {
+  stats->count += part->count;
+  stats->nodata += part->nodata;
+  stats->sum += part->sum;
+  if (part->min < stats->min)
+    stats->min = part->min;
+  if (part->max > stats->max)
+    stats->max = part->max;
+}
+
+static void stats_scalar(const int16_t *data, size_t n, struct Stats *stats) {
+  for (size_t i = 0; i < n; i++) {
+    if (data[i] == NO_DATA) {
+      stats->nodata++;
+      continue;
+    }
+    stats->count++;
+    stats->sum += data[i];
+    if (data[i] < stats->min)
+      stats->min = data[i];
+    if (data[i] > stats->max)
+      stats->max = data[i];
+  }
+}
+
+#ifdef HAVE_X86
+// NO_DATA lanes are replaced by INT16_MAX for min, INT16_MIN for max and 0 for
+// sum. Sums are widened to int32 pairs with madd and flushed to int64 every
+// STATS_BLOCK vectors, before either they or the 16-bit NO_DATA lane counts
+// can overflow.
+static __attribute__((target("sse2"))) void
+stats_sse2(const int16_t *data, size_t n, struct Stats *stats) {
+  const __m128i nodata = _mm_set1_epi16(NO_DATA);
+  const __m128i hi = _mm_set1_epi16(INT16_MAX);
+  const __m128i lo = _mm_set1_epi16(INT16_MIN);
+  const __m128i ones = _mm_set1_epi16(1);
+  __m128i vmin = hi;
+  __m128i vmax = lo;
+  size_t num_nodata = 0;
+  size_t i = 0;
+  while (i + 8 <= n) {
+    __m128i vsum = _mm_setzero_si128();
+    __m128i vnodata = _mm_setzero_si128();
+    size_t end = i + STATS_BLOCK * 8 < n ? i + STATS_BLOCK * 8 : n;
+    for (; i + 8 <= end; i += 8) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+      __m128i nd = _mm_cmpeq_epi16(v, nodata);
+      vmin = _mm_min_epi16(
+          vmin, _mm_or_si128(_mm_and_si128(nd, hi), _mm_andnot_si128(nd, v)));
+      vmax = _mm_max_epi16(
+          vmax, _mm_or_si128(_mm_and_si128(nd, lo), _mm_andnot_si128(nd, v)));
+      vsum = _mm_add_epi32(vsum, _mm_madd_epi16(_mm_andnot_si128(nd, v), ones));
+      vnodata = _mm_sub_epi16(vnodata, nd);
+    }
+    int32_t sums[4];
+    uint16_t nodatas[8];
+    _mm_storeu_si128((__m128i *)sums, vsum);
+    _mm_storeu_si128((__m128i *)nodatas, vnodata);
+    for (size_t l = 0; l < 4; l++)
+      stats->sum += sums[l];
+    for (size_t l = 0; l < 8; l++)
+      num_nodata += nodatas[l];
+  }
+  int16_t mins[8], maxs[8];
+  _mm_storeu_si128((__m128i *)mins, vmin);
+  _mm_storeu_si128((__m128i *)maxs, vmax);
+  for (size_t l = 0; l < 8; l++) {
+    if (mins[l] < stats->min)
+      stats->min = mins[l];
+    if (maxs[l] > stats->max)
+      stats->max = maxs[l];
+  }
+  stats->count += i - num_nodata;
+  stats->nodata += num_nodata;
+  stats_scalar(data + i, n - i, stats);
+}
+
+static __attribute__((target("avx2"))) void
+stats_avx2(const int16_t *data, size_t n, struct Stats *stats) {
+  const __m256i nodata = _mm256_set1_epi16(NO_DATA);
+  const __m256i hi = _mm256_set1_epi16(INT16_MAX);
+  const __m256i lo = _mm256_set1_epi16(INT16_MIN);
+  const __m256i ones = _mm256_set1_epi16(1);
+  __m256i vmin = hi;
+  __m256i vmax = lo;
+  size_t num_nodata = 0;
+  size_t i = 0;
+  while (i + 16 <= n) {
+    __m256i vsum = _mm256_setzero_si256();
+    __m256i vnodata = _mm256_setzero_si256();
+    size_t end = i + STATS_BLOCK * 16 < n ? i + STATS_BLOCK * 16 : n;
+    for (; i + 16 <= end; i += 16) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+      __m256i nd = _mm256_cmpeq_epi16(v, nodata);
+      vmin = _mm256_min_epi16(vmin, _mm256_blendv_epi8(v, hi, nd));
+      vmax = _mm256_max_epi16(vmax, _mm256_blendv_epi8(v, lo, nd));
+      vsum = _mm256_add_epi32(
+          vsum, _mm256_madd_epi16(_mm256_andnot_si256(nd, v), ones));
+      vnodata = _mm256_sub_epi16(vnodata, nd);
+    }
+    int32_t sums[8];
+    uint16_t nodatas[16];
+    _mm256_storeu_si256((__m256i *)sums, vsum);
+    _mm256_storeu_si256((__m256i *)nodatas, vnodata);
+    for (size_t l = 0; l < 8; l++)
+      stats->sum += sums[l];
+    for (size_t l = 0; l < 16; l++)
+      num_nodata += nodatas[l];
+  }
+  int16_t mins[16], maxs[16];
+  _mm256_storeu_si256((__m256i *)mins, vmin);
+  _mm256_storeu_si256((__m256i *)maxs, vmax);
+  for (size_t l = 0; l < 16; l++) {
+    if (mins[l] < stats->min)
+      stats->min = mins[l];
+    if (maxs[l] > stats->max)
+      stats->max = maxs[l];
+  }
+  stats->count += i - num_nodata;
+  stats->nodata += num_nodata;
+  stats_scalar(data + i, n - i, stats);
+}
+#endif
+
+// Add n cells to stats, using the widest vector unit the CPU has.
+static void stats_add(const int16_t *data, size_t n, struct Stats *stats) {
+#ifdef HAVE_X86
+  if (__builtin_cpu_supports("avx2"))
+    stats_avx2(data, n, stats);
+  else if (__builtin_cpu_supports("sse2"))
+    stats_sse2(data, n, stats);
+  else
+    stats_scalar(data, n, stats);
+#else
+  stats_scalar(data, n, stats);
+#endif
+}
+
+// Print stats in the merge log format.
+static void stats_print(const char *name, const struct Stats *stats) {
+  double mean = stats->count ? (double)stats->sum / stats->count : 0.0;
+  printf("name: %s, count: %zu, nodata: %zu, mean: %.2f, min: %hd, max: "
+         "%hd\n",
+         name, stats->count, stats->nodata, mean, stats->min, stats->max);
+}
+
+// Run fn(arg) on num_threads threads and wait for all of them. Runs fn on the
+// calling thread if no thread could be started.
+static void run_workers(void *(*fn)(void *), void *arg, size_t num_threads) {
+  pthread_t threads[MAX_THREADS];
+  size_t num_started = 0;
+  if (num_threads > MAX_THREADS)
+    num_threads = MAX_THREADS;
+  for (; num_started < num_threads; num_started++) {
+    if ((errno = pthread_create(&threads[num_started], NULL, fn, arg)) != 0) {
+      perror("pthread_create");
+      break;
+    }
+  }
+  if (num_started == 0)
+    fn(arg);
+  for (size_t t = 0; t < num_started; t++)
+    pthread_join(threads[t], NULL);
+}
+
+// Shared state for merge workers. Strips are one row of blocks. index holds
+// the offset of each block of tiled output and checksums the CRC-32C of each
+// block. Compressed blocks are appended at data_end in block order, each
+// strip waiting until next_write reaches it.
+struct MergeJob {
+  int chunk_fds[NUM_CHUNKS];
+  int out_fd;
+  enum GlobeLayout layout;
+  size_t strip_rows;
+  struct Stats *stats;
+  pthread_mutex_t lock;
+  pthread_cond_t turn;
+  size_t next_row;
+  size_t next_write;
+  uint64_t *index;
+  uint32_t *checksums;
+  uint64_t data_end;
+  int failed;
+};
+
+// Claim the next strip of output rows.
+static int merge_claim_strip(struct MergeJob *job, size_t *y0, size_t *y1) {
+  pthread_mutex_lock(&job->lock);
+  int claimed = !job->failed && job->next_row < GLOBE_ROWS;
+  if (claimed) {
+    *y0 = job->next_row;
+    *y1 = *y0 + job->strip_rows < GLOBE_ROWS ? *y0 + job->strip_rows
+                                              : GLOBE_ROWS;
+    job->next_row = *y1;
+  }
+  pthread_mutex_unlock(&job->lock);
+  return claimed;
+}
+
+// Append the blocks of strip y0 once the strips before it are written, and
+// record their offsets in the index.
+static int merge_append_blocks(struct MergeJob *job, size_t y0,
+                               const uint8_t *packed, const size_t *lens) {
+  size_t strip = y0 / job->strip_rows;
+  size_t len = 0;
+  for (size_t bx = 0; bx < GLOBE_BLOCKS_ACROSS; bx++)
+    len += lens[bx];
+
+  pthread_mutex_lock(&job->lock);
+  while (job->next_write != strip && !job->failed)
+    pthread_cond_wait(&job->turn, &job->lock);
+  int failed = job->failed;
+  uint64_t offset = job->data_end;
+  pthread_mutex_unlock(&job->lock);
+  if (failed)
+    return 1;
+
+  failed = pwrite_full(job->out_fd, packed, len, (off_t)offset);
+  pthread_mutex_lock(&job->lock);
+  for (size_t bx = 0; bx < GLOBE_BLOCKS_ACROSS; bx++) {
+    job->index[strip * GLOBE_BLOCKS_ACROSS + bx] = job->data_end;
+    job->data_end += lens[bx];
+  }
+  job->next_write++;
+  pthread_cond_broadcast(&job->turn);
+  pthread_mutex_unlock(&job->lock);
+  return failed;
+}
+
+// Write strip rows [y0, y1) as the row of blocks they make up, padding the
+// blocks past the edge of the globe with NO_DATA. Compressed blocks are
+// encoded into packed first.
+static int merge_write_blocks(struct MergeJob *job, size_t y0, size_t y1,
+                              const int16_t *strip_data, int16_t *block,
+                              uint8_t *packed) {
+  size_t by = y0 / GLOBE_BLOCK;
+  size_t lens[GLOBE_BLOCKS_ACROSS];
+  size_t len = 0;
+  for (size_t bx = 0; bx < GLOBE_BLOCKS_ACROSS; bx++) {
+    size_t x0 = bx * GLOBE_BLOCK;
+    size_t cols = GLOBE_COLS - x0 < GLOBE_BLOCK ? GLOBE_COLS - x0 : GLOBE_BLOCK;
+    for (size_t r = 0; r < GLOBE_BLOCK; r++) {
+      int16_t *dst = block + r * GLOBE_BLOCK;
+      size_t filled = 0;
+      if (y0 + r < y1) {
+        memcpy(dst, strip_data + r * GLOBE_COLS + x0, cols * sizeof(int16_t));
+        filled = cols;
+      }
+      for (size_t x = filled; x < GLOBE_BLOCK; x++)
+        dst[x] = NO_DATA;
+    }
+    size_t b = by * GLOBE_BLOCKS_ACROSS + bx;
+    if (job->layout == LAYOUT_COMPRESSED) {
+      lens[bx] = block_encode(block, packed + len);
+      job->checksums[b] = crc32c_update(0, packed + len, lens[bx]);
+      len += lens[bx];
+      continue;
+    }
+    job->checksums[b] =
+        crc32c_update(0, (const uint8_t *)block, GLOBE_BLOCK_BYTES);
+    off_t offset = GLOBE_DATA_OFFSET + b * GLOBE_BLOCK_BYTES;
+    if (pwrite_full(job->out_fd, block, GLOBE_BLOCK_BYTES, offset) != 0)
+      return 1;
+  }
+  if (job->layout == LAYOUT_COMPRESSED)
+    return merge_append_blocks(job, y0, packed, lens);
+  return 0;
+}
+
+// Build output rows [y0, y1) from the chunks that cover them and write them to
+// their final offset in globe.bin.
+static int merge_strip(struct MergeJob *job, size_t y0, size_t y1,
+                       int16_t *strip_data, int16_t *chunk_data, int16_t *block,
+                       uint8_t *packed) {
+  for (size_t c = 0; c < NUM_CHUNKS; c++) {
+    struct Chunk chunk = CHUNKS[c];
+    size_t band_start = chunk.row_offset;
+    size_t band_end = band_start + chunk.num_rows;
+    size_t r0 = y0 > band_start ? y0 : band_start;
+    size_t r1 = y1 < band_end ? y1 : band_end;
+    if (r0 >= r1)
+      continue;
+
+    // The strip's rows are contiguous in the chunk file.
+    size_t rows = r1 - r0;
+    size_t row_bytes = chunk.num_cols * sizeof(int16_t);
+    if (pread_full(job->chunk_fds[c], chunk_data, rows * row_bytes,
+                   (r0 - band_start) * row_bytes) != 0)
+      return 1;
+
+    // Calculate chunk stats.
+    struct Stats part = STATS_INIT;
+    stats_add(chunk_data, rows * chunk.num_cols, &part);
+    pthread_mutex_lock(&job->lock);
+    stats_merge(&job->stats[c], &part);
+    pthread_mutex_unlock(&job->lock);
+
+    // Copy chunk rows into place in the strip.
+    for (size_t row = 0; row < rows; row++) {
+      memcpy(strip_data + (r0 - y0 + row) * GLOBE_COLS + chunk.col_offset,
+             chunk_data + row * chunk.num_cols, row_bytes);
+    }
+  }
+
+  if (job->layout != LAYOUT_ROWS)
+    return merge_write_blocks(job, y0, y1, strip_data, block, packed);
+
+  // Checksum each block's part of the rows, a row at a time.
+  for (size_t bx = 0; bx < GLOBE_BLOCKS_ACROSS; bx++) {
+    size_t x0 = bx * GLOBE_BLOCK;
+    size_t cols = GLOBE_COLS - x0 < GLOBE_BLOCK ? GLOBE_COLS - x0 : GLOBE_BLOCK;
+    uint32_t crc = 0;
+    for (size_t r = 0; r < y1 - y0; r++)
+      crc = crc32c_update(crc,
+                          (const uint8_t *)(strip_data + r * GLOBE_COLS + x0),
+                          cols * sizeof(int16_t));
+    job->checksums[y0 / GLOBE_BLOCK * GLOBE_BLOCKS_ACROSS + bx] = crc;
+  }
+  if (pwrite_full(job->out_fd, strip_data,
+                  (y1 - y0) * GLOBE_COLS * sizeof(int16_t),
+                  GLOBE_DATA_OFFSET + y0 * GLOBE_COLS * sizeof(int16_t)) != 0)
+    return 1;
+
+  return 0;
+}
+
+static void *merge_worker(void *arg) {
+  struct MergeJob *job = arg;
+
+  // Alocate strip buffers. Reused and freed at the end.
+  int16_t *strip_data = malloc(job->strip_rows * GLOBE_COLS * sizeof(int16_t));
+  int16_t *chunk_data =
+      malloc(job->strip_rows * MAX_CHUNK_COLS * sizeof(int16_t));
+  int16_t *block = NULL;
+  uint8_t *packed = NULL;
+  if (job->layout != LAYOUT_ROWS)
+    block = malloc(GLOBE_BLOCK_BYTES);
+  if (job->layout == LAYOUT_COMPRESSED)
+    packed = malloc(GLOBE_BLOCKS_ACROSS * BLOCK_CODEC_MAX);
+  int failed = strip_data == NULL || chunk_data == NULL ||
+               (job->layout != LAYOUT_ROWS && block == NULL) ||
+               (job->layout == LAYOUT_COMPRESSED && packed == NULL);
+  if (failed)
+    perror("strip malloc");
+
+  size_t y0, y1;
+  while (!failed && merge_claim_strip(job, &y0, &y1)) {
+    failed =
+        merge_strip(job, y0, y1, strip_data, chunk_data, block, packed) != 0;
+  }
+  if (failed) {
+    pthread_mutex_lock(&job->lock);
+    job->failed = 1;
+    pthread_cond_broadcast(&job->turn);
+    pthread_mutex_unlock(&job->lock);
+  }
+
+  free(strip_data);
+  free(chunk_data);
+  free(block);
+  free(packed);
+  return NULL;
+}
+
+// Close chunk files and globe.bin, deleting it if the merge failed.
+static int merge_finish(struct MergeJob *job, char *out_file, int failed) {
+  for (size_t c = 0; c < NUM_CHUNKS; c++) {
+    if (job->chunk_fds[c] != -1)
+      close(job->chunk_fds[c]);
+  }
+  if (job->out_fd != -1 && close(job->out_fd) == -1) {
+    perror("close");
+    failed = 1;
+  }
+  if (failed && job->out_fd != -1)
+    unlink(out_file);
+  return failed;
+}
+
+// Write the header, index and checksums of globe.bin, once its cells are
+// written.
+static int merge_write_header(struct MergeJob *job) {
+  uint8_t *meta = calloc(1, GLOBE_DATA_OFFSET);
+  if (meta == NULL) {
+    perror("header malloc");
+    return 1;
+  }
+  struct GlobeHeader header = {GLOBE_MAGIC,
+                               GLOBE_VERSION,
+                               GLOBE_DATA_OFFSET,
+                               GLOBE_COLS,
+                               GLOBE_ROWS,
+                               -180.0,
+                               90.0,
+                               CELL_DEG,
+                               NO_DATA,
+                               GLOBE_DTYPE_INT16LE,
+                               job->layout,
+                               GLOBE_BLOCK,
+                               GLOBE_BLOCKS_ACROSS,
+                               GLOBE_BLOCKS_DOWN,
+                               job->data_end - GLOBE_DATA_OFFSET,
+                               0,
+                               0};
+  if (job->layout != LAYOUT_ROWS)
+    memcpy(meta + sizeof(header), job->index, GLOBE_INDEX_SIZE);
+  memcpy(meta + sizeof(header) + GLOBE_INDEX_SIZE, job->checksums,
+         GLOBE_BLOCKS * sizeof(uint32_t));
+  memcpy(meta, &header, sizeof(header));
+  header.crc = crc32c_update(0, meta, GLOBE_DATA_OFFSET);
+  memcpy(meta, &header, sizeof(header));
+  int failed = pwrite_full(job->out_fd, meta, GLOBE_DATA_OFFSET, 0);
+  free(meta);
+  return failed;
+}
+
+static int merge(char *out_file, enum GlobeLayout layout, size_t num_threads) {
+  struct Stats chunk_stats[NUM_CHUNKS];
+  uint64_t index[GLOBE_BLOCKS + 1];
+  uint32_t checksums[GLOBE_BLOCKS];
+  struct MergeJob job = {{0},
+                         -1,
+                         layout,
+                         GLOBE_BLOCK,
+                         chunk_stats,
+                         PTHREAD_MUTEX_INITIALIZER,
+                         PTHREAD_COND_INITIALIZER,
+                         0,
+                         0,
+                         index,
+                         checksums,
+                         GLOBE_DATA_OFFSET,
+                         0};
+  for (size_t c = 0; c < NUM_CHUNKS; c++)
+    job.chunk_fds[c] = -1;
+
+  // Open chunk files.
+  for (size_t c = 0; c < NUM_CHUNKS; c++) {
+    struct Chunk chunk = CHUNKS[c];
+    struct stat st;
+    if ((job.chunk_fds[c] = open(chunk.name, O_RDONLY)) == -1) {
+      perror("open");
+      return merge_finish(&job, out_file, 1);
+    }
+    if (fstat(job.chunk_fds[c], &st) == -1) {
+      perror("fstat");
+      return merge_finish(&job, out_file, 1);
+    }
+    size_t num_vals = (size_t)st.st_size / sizeof(int16_t);
+    if (num_vals != chunk.num_cols * chunk.num_rows) {
+      fprintf(stderr, "%s: expected %zu values, found %zu.\n", chunk.name,
+              chunk.num_cols * chunk.num_rows, num_vals);
+      return merge_finish(&job, out_file, 1);
+    }
+    chunk_stats[c] = (struct Stats)STATS_INIT;
+  }
+
+  // Open globe bin file.
+  if ((job.out_fd = open(out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) ==
+      -1) {
+    perror("open");
+    return merge_finish(&job, out_file, 1);
+  }
+
+  // Raw cells and blocks have fixed offsets, compressed blocks are placed as
+  // they are written.
+  if (layout == LAYOUT_ROWS)
+    job.data_end += GLOBE_CELLS * sizeof(int16_t);
+  if (layout == LAYOUT_TILED) {
+    for (size_t b = 0; b <= GLOBE_BLOCKS; b++)
+      index[b] = GLOBE_DATA_OFFSET + b * GLOBE_BLOCK_BYTES;
+    job.data_end = index[GLOBE_BLOCKS];
+  }
+
+  // Stream strips of rows from the chunks to globe.bin in parallel, then
+  // write the header.
+  run_workers(merge_worker, &job, num_threads);
+  if (layout == LAYOUT_COMPRESSED)
+    index[GLOBE_BLOCKS] = job.data_end;
+  if (!job.failed && merge_write_header(&job) != 0)
+    job.failed = 1;
+  if (merge_finish(&job, out_file, job.failed) != 0)
+    return 1;
+
+  // Log debug info.
+  for (size_t c = 0; c < NUM_CHUNKS; c++)
+    stats_print(CHUNKS[c].name, &chunk_stats[c]);
+
+  return 0;
+}
+
+// Shared state for stats workers.
+struct StatsJob {
+  struct Globe *globe;
+  struct Stats *chunk_stats;
+  pthread_mutex_t lock;
+  size_t next_chunk;
+  int failed;
+};
+
+static void *stats_worker(void *arg) {
+  struct StatsJob *job = arg;
+  int16_t *buf = malloc(GLOBE_COLS * sizeof(int16_t));
+  if (buf == NULL) {
+    perror("stats malloc");
+    pthread_mutex_lock(&job->lock);
+    job->failed = 1;
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+  }
+  for (;;) {
+    // Claim the next chunk.
+    pthread_mutex_lock(&job->lock);
+    size_t c = job->next_chunk++;
+    int done = c >= NUM_CHUNKS || job->failed;
+    pthread_mutex_unlock(&job->lock);
+    if (done)
+      break;
+
+    // Chunks cover disjoint regions, so each worker owns its result.
+    struct Chunk chunk = CHUNKS[c];
+    struct Stats part = STATS_INIT;
+    for (size_t row = 0; row < chunk.num_rows; row++) {
+      const int16_t *cells =
+          globe_row(job->globe, chunk.row_offset + row, chunk.col_offset,
+                    chunk.col_offset + chunk.num_cols, buf);
+      if (cells == NULL) {
+        pthread_mutex_lock(&job->lock);
+        job->failed = 1;
+        pthread_mutex_unlock(&job->lock);
+        break;
+      }
+      stats_add(cells + chunk.col_offset, chunk.num_cols, &part);
+    }
+    job->chunk_stats[c] = part;
+  }
+  free(buf);
+  return NULL;
+}
+
+// Print stats for each chunk region of globe.bin and for the whole globe.
+static int stats(char *in_file, size_t num_threads) {
+  struct Globe globe;
+  if (globe_open(&globe, in_file, MADV_SEQUENTIAL) != 0)
+    return 1;
+
+  struct Stats chunk_stats[NUM_CHUNKS];
+  struct StatsJob job = {&globe, chunk_stats, PTHREAD_MUTEX_INITIALIZER, 0,
+                         0};
+  run_workers(stats_worker, &job, num_threads);
+  globe_close(&globe);
+  if (job.failed)
+    return 1;
+
+  struct Stats total = STATS_INIT;
+  for (size_t c = 0; c < NUM_CHUNKS; c++) {
+    stats_print(CHUNKS[c].name, &chunk_stats[c]);
+    stats_merge(&total, &chunk_stats[c]);
+  }
+  stats_print("globe", &total);
+
+  return 0;
+}
+
+// write until len bytes are written.
+static int write_full(int fd, const void *buf, size_t len) {
+  const uint8_t *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1) {
+      perror("write");
+      return 1;
+    }
+    p += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+// Longitude of column x. Computed from the index rather than accumulated, so
+// there is no drift across the row.
+static double cell_lon(size_t x, enum CellAnchor anchor) {
+  double offset = anchor == CELL_CENTER ? 0.5 : 0.0;
+  return -180.0 + ((double)x + offset) * CELL_DEG;
+}
+
+// Latitude of row y, see cell_lon.
+static double cell_lat(size_t y, enum CellAnchor anchor) {
+  double offset = anchor == CELL_CENTER ? 0.5 : 0.0;
+  return 90.0 - ((double)y + offset) * CELL_DEG;
+}
+
+// Coordinates of every column and row, preformatted as "%f," so table only
+// has to copy them.
+struct CoordStrings {
+  char (*lon)[COORD_STR_LEN];
+  char (*lat)[COORD_STR_LEN];
+  uint8_t *lon_len;
+  uint8_t *lat_len;
+};
+
+static void coord_strings_free(struct CoordStrings *coords) {
+  free(coords->lon);
+  free(coords->lat);
+  free(coords->lon_len);
+  free(coords->lat_len);
+}
+
+static int coord_strings_init(struct CoordStrings *coords,
+                              enum CellAnchor anchor) {
+  coords->lon = malloc(GLOBE_COLS * COORD_STR_LEN);
+  coords->lat = malloc(GLOBE_ROWS * COORD_STR_LEN);
+  coords->lon_len = malloc(GLOBE_COLS);
+  coords->lat_len = malloc(GLOBE_ROWS);
+  if (coords->lon == NULL || coords->lat == NULL || coords->lon_len == NULL ||
+      coords->lat_len == NULL) {
+    perror("coords malloc");
+    coord_strings_free(coords);
+    return 1;
+  }
+
+  for (size_t x = 0; x < GLOBE_COLS; x++) {
+    coords->lon_len[x] =
+        snprintf(coords->lon[x], COORD_STR_LEN, "%f,", cell_lon(x, anchor));
+  }
+  for (size_t y = 0; y < GLOBE_ROWS; y++) {
+    coords->lat_len[y] =
+        snprintf(coords->lat[y], COORD_STR_LEN, "%f,", cell_lat(y, anchor));
+  }
+
+  return 0;
+}
+
+// Cells exported by table and parquet. The default filter keeps every cell
+// with data except sea level, which makes up most of the ocean.
+struct Filter {
+  struct Window win;
+  int16_t min_elev;
+  int16_t max_elev;
+  int skip_zero;
+};
+
+// Whether a single cell passes the elevation part of filter.
+static int keep_cell(const struct Filter *filter, int16_t elevation) {
+  return elevation != NO_DATA && elevation >= filter->min_elev &&
+         elevation <= filter->max_elev &&
+         !(filter->skip_zero && elevation == 0);
+}
+
+static size_t filter_row_scalar(const struct Filter *filter, const int16_t *row,
+                                uint16_t *sel) {
+  size_t n = 0;
+  for (size_t x = filter->win.minx; x < filter->win.maxx; x++) {
+    if (keep_cell(filter, row[x]))
+      sel[n++] = (uint16_t)x;
+  }
+  return n;
+}
+
+#ifdef HAVE_X86
+// Cells are compared 8 or 16 at a time and the passing lanes are pulled out
+// of the movemask, two mask bits per int16 lane.
+static __attribute__((target("sse2"))) size_t
+filter_row_sse2(const struct Filter *filter, const int16_t *row,
+                uint16_t *sel) {
+  const __m128i lo = _mm_set1_epi16(filter->min_elev);
+  const __m128i hi = _mm_set1_epi16(filter->max_elev);
+  const __m128i nodata = _mm_set1_epi16(NO_DATA);
+  const __m128i zero = filter->skip_zero ? _mm_setzero_si128() : nodata;
+  size_t n = 0;
+  size_t x = filter->win.minx;
+  for (; x + 8 <= filter->win.maxx; x += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(row + x));
+    __m128i drop = _mm_or_si128(_mm_cmplt_epi16(v, lo), _mm_cmpgt_epi16(v, hi));
+    drop = _mm_or_si128(drop, _mm_cmpeq_epi16(v, nodata));
+    drop = _mm_or_si128(drop, _mm_cmpeq_epi16(v, zero));
+    unsigned int mask = ~(unsigned int)_mm_movemask_epi8(drop) & 0x5555;
+    while (mask) {
+      sel[n++] = (uint16_t)(x + __builtin_ctz(mask) / 2);
+      mask &= mask - 1;
+    }
+  }
+  for (; x < filter->win.maxx; x++) {
+    if (keep_cell(filter, row[x]))
+      sel[n++] = (uint16_t)x;
+  }
+  return n;
+}
+
+static __attribute__((target("avx2"))) size_t
+filter_row_avx2(const struct Filter *filter, const int16_t *row,
+                uint16_t *sel) {
+  const __m256i lo = _mm256_set1_epi16(filter->min_elev);
+  const __m256i hi = _mm256_set1_epi16(filter->max_elev);
+  const __m256i nodata = _mm256_set1_epi16(NO_DATA);
+  const __m256i zero = filter->skip_zero ? _mm256_setzero_si256() : nodata;
+  size_t n = 0;
+  size_t x = filter->win.minx;
+  for (; x + 16 <= filter->win.maxx; x += 16) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(row + x));
+    __m256i drop =
+        _mm256_or_si256(_mm256_cmpgt_epi16(lo, v), _mm256_cmpgt_epi16(v, hi));
+    drop = _mm256_or_si256(drop, _mm256_cmpeq_epi16(v, nodata));
+    drop = _mm256_or_si256(drop, _mm256_cmpeq_epi16(v, zero));
+    uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(drop) & 0x55555555;
+    while (mask) {
+      sel[n++] = (uint16_t)(x + __builtin_ctz(mask) / 2);
+      mask &= mask - 1;
+    }
+  }
+  for (; x < filter->win.maxx; x++) {
+    if (keep_cell(filter, row[x]))
+      sel[n++] = (uint16_t)x;
+  }
+  return n;
+}
+#endif
+
+// Write the columns of row that pass filter to sel, returns how many did.
+// sel must hold GLOBE_COLS values.
+static size_t filter_row(const struct Filter *filter, const int16_t *row,
+                         uint16_t *sel) {
+#ifdef HAVE_X86
+  if (__builtin_cpu_supports("avx2"))
+    return filter_row_avx2(filter, row, sel);
+  if (__builtin_cpu_supports("sse2"))
+    return filter_row_sse2(filter, row, sel);
+#endif
+  return filter_row_scalar(filter, row, sel);
+}
+
+// Format value as "%d\n" at out, returns the number of bytes written.
+static size_t format_elev(int16_t value, char *out) {
+  char digits[8];
+  size_t n = 0;
+  size_t len = 0;
+  unsigned int v = value < 0 ? -(int)value : value;
+  do {
+    digits[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v > 0);
+  if (value < 0)
+    out[len++] = '-';
+  while (n > 0)
+    out[len++] = digits[--n];
+  out[len++] = '\n';
+  return len;
+}
+
+// Format the selected cells of row y as "lon,lat,elev\n" lines, returns the
+// number of bytes written. out must hold at least CSV_ROW_MAX bytes.
+static size_t format_csv_row(const struct CoordStrings *coords, size_t y,
+                             const int16_t *row, const uint16_t *sel, size_t n,
+                             char *out) {
+  const char *lat = coords->lat[y];
+  size_t lat_len = coords->lat_len[y];
+  char *p = out;
+  for (size_t i = 0; i < n; i++) {
+    size_t x = sel[i];
+    // Strings are padded to COORD_STR_LEN, so copy a fixed size and only
+    // advance by their length.
+    memcpy(p, coords->lon[x], COORD_STR_LEN);
+    p += coords->lon_len[x];
+    memcpy(p, lat, COORD_STR_LEN);
+    p += lat_len;
+    p += format_elev(row[x], p);
+  }
+  return p - out;
+}
+
+// Write the selected cells of row y as packed little-endian (uint32 cell
+// index, int16 elev) records, returns the number of bytes written.
+static size_t format_cells_row(size_t y, const int16_t *row,
+                               const uint16_t *sel, size_t n, char *out) {
+  char *p = out;
+  for (size_t i = 0; i < n; i++) {
+    uint32_t idx = (uint32_t)(y * GLOBE_COLS + sel[i]);
+    memcpy(p, &idx, sizeof(idx));
+    memcpy(p + sizeof(idx), &row[sel[i]], sizeof(int16_t));
+    p += CELL_RECORD_SIZE;
+  }
+  return p - out;
+}
+
+// Write the selected cells of row y as packed little-endian (float lon, float
+// lat, int16 elev) records, returns the number of bytes written.
+static size_t format_points_row(enum CellAnchor anchor, size_t y,
+                                const int16_t *row, const uint16_t *sel,
+                                size_t n, char *out) {
+  float lat = (float)cell_lat(y, anchor);
+  char *p = out;
+  for (size_t i = 0; i < n; i++) {
+    float lon = (float)cell_lon(sel[i], anchor);
+    memcpy(p, &lon, sizeof(lon));
+    memcpy(p + sizeof(lon), &lat, sizeof(lat));
+    memcpy(p + sizeof(lon) + sizeof(lat), &row[sel[i]], sizeof(int16_t));
+    p += POINT_RECORD_SIZE;
+  }
+  return p - out;
+}
+
+// Shared state for table workers.
+struct TableJob {
+  struct Globe *globe;
+  struct CoordStrings *coords;
+  const struct Filter *filter;
+  enum TableFormat format;
+  enum CellAnchor anchor;
+  int fd;
+  pthread_mutex_t lock;
+  pthread_cond_t turn;
+  size_t next_block;
+  size_t next_write;
+  int failed;
+};
+
+// Workers format blocks of rows into their own buffer, then wait for their
+// turn to write, so the output is in row order no matter which worker
+// finishes first.
+static void *table_worker(void *arg) {
+  struct TableJob *job = arg;
+  struct Window win = job->filter->win;
+  size_t rows_per_block = CSV_BUF_SIZE / CSV_ROW_MAX;
+  size_t num_rows = win.maxy - win.miny;
+  size_t num_blocks = (num_rows + rows_per_block - 1) / rows_per_block;
+
+  char *buf = malloc(CSV_BUF_SIZE);
+  uint16_t *sel = malloc(GLOBE_COLS * sizeof(uint16_t));
+  int16_t *cells = malloc(GLOBE_COLS * sizeof(int16_t));
+  if (buf == NULL || sel == NULL || cells == NULL) {
+    perror("table malloc");
+    free(buf);
+    free(sel);
+    free(cells);
+    pthread_mutex_lock(&job->lock);
+    job->failed = 1;
+    pthread_cond_broadcast(&job->turn);
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+  }
+
+  for (;;) {
+    // Claim the next block.
+    pthread_mutex_lock(&job->lock);
+    size_t block = job->next_block++;
+    int done = block >= num_blocks || job->failed;
+    pthread_mutex_unlock(&job->lock);
+    if (done)
+      break;
+
+    // Filter, then format only the cells that passed.
+    size_t y0 = win.miny + block * rows_per_block;
+    size_t y1 = y0 + rows_per_block < win.maxy ? y0 + rows_per_block
+                                                : win.maxy;
+    size_t len = 0;
+    int unreadable = 0;
+    for (size_t y = y0; y < y1; y++) {
+      const int16_t *row = globe_row(job->globe, y, win.minx, win.maxx, cells);
+      if ((unreadable = row == NULL))
+        break;
+      size_t n = filter_row(job->filter, row, sel);
+      switch (job->format) {
+      case TABLE_CSV:
+        len += format_csv_row(job->coords, y, row, sel, n, buf + len);
+        break;
+      case TABLE_CELLS:
+        len += format_cells_row(y, row, sel, n, buf + len);
+        break;
+      case TABLE_POINTS:
+        len += format_points_row(job->anchor, y, row, sel, n, buf + len);
+        break;
+      }
+    }
+
+    // Wait for the previous block to be written, then write this one.
+    pthread_mutex_lock(&job->lock);
+    if (unreadable) {
+      job->failed = 1;
+      pthread_cond_broadcast(&job->turn);
+    }
+    while (job->next_write != block && !job->failed)
+      pthread_cond_wait(&job->turn, &job->lock);
+    done = job->failed;
+    pthread_mutex_unlock(&job->lock);
+    if (done)
+      break;
+    int failed = write_full(job->fd, buf, len);
+    pthread_mutex_lock(&job->lock);
+    job->next_write++;
+    job->failed |= failed;
+    pthread_cond_broadcast(&job->turn);
+    pthread_mutex_unlock(&job->lock);
+  }
+
+  free(buf);
+  free(sel);
+  free(cells);
+  return NULL;
+}
+
+static int table(char *in_file, char *out_file, const struct Filter *filter,
+                 enum TableFormat format, enum CellAnchor anchor,
+                 size_t num_threads) {
+  // Map globe, the rows of the filter window are read front to back.
+  struct Globe globe;
+  if (globe_open(&globe, in_file, MADV_SEQUENTIAL) != 0)
+    return 1;
+
+  struct CoordStrings coords;
+  if (coord_strings_init(&coords, anchor) != 0) {
+    globe_close(&globe);
+    return 1;
+  }
+
+  // Open output.
+  int fd;
+  if ((fd = open(out_file, O_WRONLY | O_CREAT | O_APPEND, 0644)) == -1) {
+    perror("open");
+    coord_strings_free(&coords);
+    globe_close(&globe);
+    return 1;
+  }
+
+  // Format and write rows in parallel.
+  const char header[] = "lon,lat,elev\n";
+  struct TableJob job = {&globe,
+                         &coords,
+                         filter,
+                         format,
+                         anchor,
+                         fd,
+                         PTHREAD_MUTEX_INITIALIZER,
+                         PTHREAD_COND_INITIALIZER,
+                         0,
+                         0,
+                         0};
+  if (format == TABLE_CSV)
+    job.failed = write_full(fd, header, sizeof(header) - 1);
+  if (!job.failed)
+    run_workers(table_worker, &job, num_threads);
+
+  // Done, close files.
+  if (close(fd) == -1) {
+    perror("close");
+    job.failed = 1;
+  }
+  coord_strings_free(&coords);
+  globe_close(&globe);
+
+  return job.failed;
+}
+
+// Growable byte buffer. failed is set, and further writes dropped, if it
+// can't grow.
+struct Buf {
+  uint8_t *data;
+  size_t len;
+  size_t cap;
+  int failed;
+};
+
+static void buf_put(struct Buf *buf, const void *src, size_t len) {
+  if (buf->failed)
+    return;
+  if (buf->len + len > buf->cap) {
+    size_t cap = buf->cap ? buf->cap : 256;
+    while (cap < buf->len + len)
+      cap *= 2;
+    uint8_t *data = realloc(buf->data, cap);
+    if (data == NULL) {
+      perror("buf realloc");
+      buf->failed = 1;
+      return;
+    }
+    buf->data = data;
+    buf->cap = cap;
+  }
+  memcpy(buf->data + buf->len, src, len);
+  buf->len += len;
+}
+
+static void buf_byte(struct Buf *buf, uint8_t byte) { buf_put(buf, &byte, 1); }
+
+// Thrift compact protocol writer, enough of it for Parquet metadata.
+struct Thrift {
+  struct Buf buf;
+  int16_t last_id[THRIFT_MAX_DEPTH];
+  size_t depth;
+};
+
+static void thrift_varint(struct Thrift *t, uint64_t v) {
+  while (v >= 0x80) {
+    buf_byte(&t->buf, (uint8_t)(v | 0x80));
+    v >>= 7;
+  }
+  buf_byte(&t->buf, (uint8_t)v);
+}
+
+static void thrift_zigzag(struct Thrift *t, int64_t v) {
+  thrift_varint(t, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static void thrift_field(struct Thrift *t, int16_t id, uint8_t type) {
+  int16_t delta = id - t->last_id[t->depth];
+  if (delta > 0 && delta <= 15) {
+    buf_byte(&t->buf, (uint8_t)(delta << 4 | type));
+  } else {
+    buf_byte(&t->buf, type);
+    thrift_zigzag(t, id);
+  }
+  t->last_id[t->depth] = id;
+}
+
+static void thrift_i32(struct Thrift *t, int16_t id, int32_t v) {
+  thrift_field(t, id, THRIFT_I32);
+  thrift_zigzag(t, v);
+}
+
+static void thrift_i64(struct Thrift *t, int16_t id, int64_t v) {
+  thrift_field(t, id, THRIFT_I64);
+  thrift_zigzag(t, v);
+}
+
+static void thrift_binary(struct Thrift *t, int16_t id, const void *data,
+                          size_t len) {
+  thrift_field(t, id, THRIFT_BINARY);
+  thrift_varint(t, len);
+  buf_put(&t->buf, data, len);
+}
+
+static void thrift_list(struct Thrift *t, int16_t id, uint8_t type, size_t n) {
+  thrift_field(t, id, THRIFT_LIST);
+  if (n < 15) {
+    buf_byte(&t->buf, (uint8_t)(n << 4 | type));
+  } else {
+    buf_byte(&t->buf, 0xf0 | type);
+    thrift_varint(t, n);
+  }
+}
+
+// Begin a struct. Pass id 0 for a struct that is a list element.
+static void thrift_begin(struct Thrift *t, int16_t id) {
+  if (id != 0)
+    thrift_field(t, id, THRIFT_STRUCT);
+  t->last_id[++t->depth] = 0;
+}
+
+static void thrift_end(struct Thrift *t) {
+  buf_byte(&t->buf, 0);
+  t->depth--;
+}
+
+// Column of a Parquet export, with the schema it is written with.
+struct ParquetColumn {
+  const char *name;
+  int32_t type;
+  int32_t converted_type;
+  size_t width;
+};
+
+static const struct ParquetColumn PARQUET_COLUMNS[PARQUET_NUM_COLUMNS] = {
+    {"lon", PARQUET_DOUBLE, -1, sizeof(double)},
+    {"lat", PARQUET_DOUBLE, -1, sizeof(double)},
+    {"elev", PARQUET_INT32, PARQUET_INT_16, sizeof(int32_t)}};
+
+// Where a column chunk landed in the file, for the footer.
+struct ParquetChunkMeta {
+  int64_t offset;
+  int64_t size;
+  uint8_t min[8];
+  uint8_t max[8];
+};
+
+// Streaming Parquet writer. Cells are buffered one row group at a time, so
+// memory is bounded by the row group size, not the export size.
+struct Parquet {
+  int fd;
+  int64_t offset;
+  size_t row_group_size;
+  size_t num_rows;
+  double *lon;
+  double *lat;
+  int32_t *elev;
+  // One entry per column of each row group written so far.
+  struct ParquetChunkMeta *chunks;
+  int64_t *group_rows;
+  size_t num_groups;
+  size_t total_rows;
+};
+
+static int parquet_write(struct Parquet *pq, const void *data, size_t len) {
+  if (write_full(pq->fd, data, len) != 0)
+    return 1;
+  pq->offset += len;
+  return 0;
+}
+
+// Write one column of the buffered row group as a run of PLAIN data pages.
+static int parquet_write_column(struct Parquet *pq, size_t col,
+                                struct ParquetChunkMeta *meta) {
+  const struct ParquetColumn *column = &PARQUET_COLUMNS[col];
+  const uint8_t *values = col == 0   ? (const uint8_t *)pq->lon
+                          : col == 1 ? (const uint8_t *)pq->lat
+                                     : (const uint8_t *)pq->elev;
+
+  meta->offset = pq->offset;
+  for (size_t start = 0; start < pq->num_rows; start += PARQUET_PAGE_VALUES) {
+    size_t n = pq->num_rows - start < PARQUET_PAGE_VALUES
+                   ? pq->num_rows - start
+                   : PARQUET_PAGE_VALUES;
+    size_t page_bytes = n * column->width;
+
+    // Page header. Columns are required, so pages hold no levels.
+    struct Thrift t = {{0}, {0}, 0};
+    thrift_i32(&t, 1, PARQUET_DATA_PAGE);
+    thrift_i32(&t, 2, (int32_t)page_bytes);
+    thrift_i32(&t, 3, (int32_t)page_bytes);
+    thrift_begin(&t, 5);
+    thrift_i32(&t, 1, (int32_t)n);
+    thrift_i32(&t, 2, PARQUET_PLAIN);
+    thrift_i32(&t, 3, PARQUET_RLE);
+    thrift_i32(&t, 4, PARQUET_RLE);
+    thrift_end(&t);
+    buf_byte(&t.buf, 0);
+
+    int failed = t.buf.failed ||
+                 parquet_write(pq, t.buf.data, t.buf.len) != 0 ||
+                 parquet_write(pq, values + start * column->width,
+                               page_bytes) != 0;
+    free(t.buf.data);
+    if (failed)
+      return 1;
+  }
+  meta->size = pq->offset - meta->offset;
+
+  // Column chunk min/max, PLAIN encoded.
+  if (column->type == PARQUET_DOUBLE) {
+    const double *v = (const double *)values;
+    double min = v[0], max = v[0];
+    for (size_t i = 1; i < pq->num_rows; i++) {
+      min = v[i] < min ? v[i] : min;
+      max = v[i] > max ? v[i] : max;
+    }
+    memcpy(meta->min, &min, sizeof(min));
+    memcpy(meta->max, &max, sizeof(max));
+  } else {
+    const int32_t *v = (const int32_t *)values;
+    int32_t min = v[0], max = v[0];
+    for (size_t i = 1; i < pq->num_rows; i++) {
+      min = v[i] < min ? v[i] : min;
+      max = v[i] > max ? v[i] : max;
+    }
+    memcpy(meta->min, &min, sizeof(min));
+    memcpy(meta->max, &max, sizeof(max));
+  }
+
+  return 0;
+}
+
+// Write the buffered cells as a row group.
+static int parquet_flush(struct Parquet *pq) {
+  if (pq->num_rows == 0)
+    return 0;
+
+  size_t g = pq->num_groups;
+  struct ParquetChunkMeta *chunks =
+      realloc(pq->chunks, (g + 1) * PARQUET_NUM_COLUMNS * sizeof(*chunks));
+  if (chunks == NULL) {
+    perror("parquet realloc");
+    return 1;
+  }
+  pq->chunks = chunks;
+  int64_t *group_rows = realloc(pq->group_rows, (g + 1) * sizeof(int64_t));
+  if (group_rows == NULL) {
+    perror("parquet realloc");
+    return 1;
+  }
+  pq->group_rows = group_rows;
+
+  for (size_t col = 0; col < PARQUET_NUM_COLUMNS; col++) {
+    if (parquet_write_column(pq, col, &chunks[g * PARQUET_NUM_COLUMNS + col]) !=
+        0)
+      return 1;
+  }
+  group_rows[g] = pq->num_rows;
+  pq->num_groups++;
+  pq->total_rows += pq->num_rows;
+  pq->num_rows = 0;
+
+  return 0;
+}
+
+// Write the file footer: FileMetaData, its length and the magic.
+static int parquet_finish(struct Parquet *pq) {
+  struct Thrift t = {{0}, {0}, 0};
+  thrift_i32(&t, 1, 1);
+
+  // Schema, a root group and one leaf per column.
+  thrift_list(&t, 2, THRIFT_STRUCT, PARQUET_NUM_COLUMNS + 1);
+  thrift_begin(&t, 0);
+  thrift_binary(&t, 4, "schema", 6);
+  thrift_i32(&t, 5, PARQUET_NUM_COLUMNS);
+  thrift_end(&t);
+  for (size_t col = 0; col < PARQUET_NUM_COLUMNS; col++) {
+    const struct ParquetColumn *column = &PARQUET_COLUMNS[col];
+    thrift_begin(&t, 0);
+    thrift_i32(&t, 1, column->type);
+    thrift_i32(&t, 3, PARQUET_REQUIRED);
+    thrift_binary(&t, 4, column->name, strlen(column->name));
+    if (column->converted_type != -1)
+      thrift_i32(&t, 6, column->converted_type);
+    thrift_end(&t);
+  }
+  thrift_i64(&t, 3, pq->total_rows);
+
+  // Row groups.
+  thrift_list(&t, 4, THRIFT_STRUCT, pq->num_groups);
+  for (size_t g = 0; g < pq->num_groups; g++) {
+    const struct ParquetChunkMeta *chunks =
+        &pq->chunks[g * PARQUET_NUM_COLUMNS];
+    int64_t group_bytes = 0;
+    for (size_t col = 0; col < PARQUET_NUM_COLUMNS; col++)
+      group_bytes += chunks[col].size;
+
+    thrift_begin(&t, 0);
+    thrift_list(&t, 1, THRIFT_STRUCT, PARQUET_NUM_COLUMNS);
+    for (size_t col = 0; col < PARQUET_NUM_COLUMNS; col++) {
+      const struct ParquetColumn *column = &PARQUET_COLUMNS[col];
+      thrift_begin(&t, 0);
+      thrift_i64(&t, 2, chunks[col].offset);
+      thrift_begin(&t, 3);
+      thrift_i32(&t, 1, column->type);
+      thrift_list(&t, 2, THRIFT_I32, 1);
+      thrift_zigzag(&t, PARQUET_PLAIN);
+      thrift_list(&t, 3, THRIFT_BINARY, 1);
+      thrift_varint(&t, strlen(column->name));
+      buf_put(&t.buf, column->name, strlen(column->name));
+      thrift_i32(&t, 4, PARQUET_UNCOMPRESSED);
+      thrift_i64(&t, 5, pq->group_rows[g]);
+      thrift_i64(&t, 6, chunks[col].size);
+      thrift_i64(&t, 7, chunks[col].size);
+      thrift_i64(&t, 9, chunks[col].offset);
+      thrift_begin(&t, 12);
+      thrift_i64(&t, 3, 0);
+      thrift_binary(&t, 5, chunks[col].max, column->width);
+      thrift_binary(&t, 6, chunks[col].min, column->width);
+      thrift_end(&t);
+      thrift_end(&t);
+      thrift_end(&t);
+    }
+    thrift_i64(&t, 2, group_bytes);
+    thrift_i64(&t, 3, pq->group_rows[g]);
+    thrift_end(&t);
+  }
+  thrift_binary(&t, 6, "globe.c", 7);
+
+  // Min/max above use the natural order of each type.
+  thrift_list(&t, 7, THRIFT_STRUCT, PARQUET_NUM_COLUMNS);
+  for (size_t col = 0; col < PARQUET_NUM_COLUMNS; col++) {
+    thrift_begin(&t, 0);
+    thrift_begin(&t, 1);
+    thrift_end(&t);
+    thrift_end(&t);
+  }
+  buf_byte(&t.buf, 0);
+
+  uint32_t footer_len = (uint32_t)t.buf.len;
+  int failed = t.buf.failed ||
+               parquet_write(pq, t.buf.data, t.buf.len) != 0 ||
+               parquet_write(pq, &footer_len, sizeof(footer_len)) != 0 ||
+               parquet_write(pq, PARQUET_MAGIC, 4) != 0;
+  free(t.buf.data);
+
+  return failed;
+}
+
+static void parquet_free(struct Parquet *pq) {
+  free(pq->lon);
+  free(pq->lat);
+  free(pq->elev);
+  free(pq->chunks);
+  free(pq->group_rows);
+}
+
+static int parquet(char *in_file, char *out_file, const struct Filter *filter,
+                   enum CellAnchor anchor, size_t row_group_size) {
+  // Map globe, the rows of the filter window are read front to back.
+  struct Globe globe;
+  if (globe_open(&globe, in_file, MADV_SEQUENTIAL) != 0)
+    return 1;
+
+  struct Parquet pq = {-1, 0, row_group_size, 0, NULL, NULL,
+                       NULL, NULL, NULL, 0, 0};
+  pq.lon = malloc(row_group_size * sizeof(double));
+  pq.lat = malloc(row_group_size * sizeof(double));
+  pq.elev = malloc(row_group_size * sizeof(int32_t));
+  double *col_lon = malloc(GLOBE_COLS * sizeof(double));
+  uint16_t *sel = malloc(GLOBE_COLS * sizeof(uint16_t));
+  int16_t *cells = malloc(GLOBE_COLS * sizeof(int16_t));
+  if (pq.lon == NULL || pq.lat == NULL || pq.elev == NULL || col_lon == NULL ||
+      sel == NULL || cells == NULL) {
+    perror("parquet malloc");
+    free(col_lon);
+    free(sel);
+    free(cells);
+    parquet_free(&pq);
+    globe_close(&globe);
+    return 1;
+  }
+  for (size_t x = 0; x < GLOBE_COLS; x++)
+    col_lon[x] = cell_lon(x, anchor);
+
+  // Open parquet file.
+  if ((pq.fd = open(out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+    perror("open");
+    free(col_lon);
+    free(sel);
+    free(cells);
+    parquet_free(&pq);
+    globe_close(&globe);
+    return 1;
+  }
+
+  // Traverse cells that pass the filter, writing a row group whenever the
+  // buffers fill up.
+  int failed = parquet_write(&pq, PARQUET_MAGIC, 4);
+  for (size_t y = filter->win.miny; y < filter->win.maxy && !failed; y++) {
+    const int16_t *row =
+        globe_row(&globe, y, filter->win.minx, filter->win.maxx, cells);
+    if (row == NULL) {
+      failed = 1;
+      break;
+    }
+    double lat = cell_lat(y, anchor);
+    size_t n = filter_row(filter, row, sel);
+    for (size_t i = 0; i < n; i++) {
+      size_t x = sel[i];
+      pq.lon[pq.num_rows] = col_lon[x];
+      pq.lat[pq.num_rows] = lat;
+      pq.elev[pq.num_rows] = row[x];
+      if (++pq.num_rows == pq.row_group_size && parquet_flush(&pq) != 0) {
+        failed = 1;
+        break;
+      }
+    }
+  }
+  if (!failed)
+    failed = parquet_flush(&pq) != 0 || parquet_finish(&pq) != 0;
+
+  // Done, close files.
+  if (close(pq.fd) == -1) {
+    perror("close");
+    failed = 1;
+  }
+  if (failed)
+    unlink(out_file);
+  free(col_lon);
+  free(sel);
+  free(cells);
+  parquet_free(&pq);
+  globe_close(&globe);
+
+  return failed;
+}
+
+// Adler-32 of zlib streams. Sums are reduced every ADLER_NMAX bytes, the most
+// that can be added before they overflow 32 bits.
+static uint32_t adler_update(uint32_t adler, const uint8_t *buf, size_t len) {
+  uint32_t a = adler & 0xffff;
+  uint32_t b = adler >> 16;
+  while (len > 0) {
+    size_t n = len < ADLER_NMAX ? len : ADLER_NMAX;
+    len -= n;
+    while (n--) {
+      a += *buf++;
+      b += a;
+    }
+    a %= ADLER_BASE;
+    b %= ADLER_BASE;
+  }
+  return b << 16 | a;
+}
+
+// Adler-32 of two buffers joined, from the Adler-32 of each and the length
+// of the second. This is what lets strips be checksummed independently.
+static uint32_t adler_combine(uint32_t adler1, uint32_t adler2, size_t len2) {
+  uint32_t rem = (uint32_t)(len2 % ADLER_BASE);
+  uint32_t sum1 = adler1 & 0xffff;
+  uint32_t sum2 = (uint32_t)((uint64_t)rem * sum1 % ADLER_BASE);
+  sum1 += (adler2 & 0xffff) + ADLER_BASE - 1;
+  sum2 += (adler1 >> 16) + (adler2 >> 16) + ADLER_BASE - rem;
+  if (sum1 >= ADLER_BASE)
+    sum1 -= ADLER_BASE;
+  if (sum1 >= ADLER_BASE)
+    sum1 -= ADLER_BASE;
+  if (sum2 >= ADLER_BASE * 2)
+    sum2 -= ADLER_BASE * 2;
+  if (sum2 >= ADLER_BASE)
+    sum2 -= ADLER_BASE;
+  return sum2 << 16 | sum1;
+}
+
+#ifndef GLOBE_ZLIB
+// Fixed Huffman codes of deflate, bit reversed so they can be written LSB
+// first, and the length and distance code tables.
+struct DeflateTables {
+  uint16_t lit_code[288];
+  uint8_t lit_bits[288];
+  uint16_t len_sym[259];
+  uint8_t dist_code[DEFLATE_WINDOW + 1];
+};
+
+static struct DeflateTables deflate_tables;
+static pthread_once_t deflate_tables_once = PTHREAD_ONCE_INIT;
+
+static const uint16_t DEFLATE_LEN_BASE[29] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t DEFLATE_LEN_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                              1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                              4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t DEFLATE_DIST_BASE[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t DEFLATE_DIST_EXTRA[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+    6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static uint32_t bit_reverse(uint32_t code, int bits) {
+  uint32_t r = 0;
+  for (int i = 0; i < bits; i++) {
+    r = r << 1 | (code & 1);
+    code >>= 1;
+  }
+  return r;
+}
+
+static void deflate_tables_init(void) {
+  struct DeflateTables *t = &deflate_tables;
+  for (int v = 0; v < 288; v++) {
+    uint32_t code;
+    int bits;
+    if (v <= 143) {
+      code = 0x30 + v;
+      bits = 8;
+    } else if (v <= 255) {
+      code = 0x190 + v - 144;
+      bits = 9;
+    } else if (v <= 279) {
+      code = v - 256;
+      bits = 7;
+    } else {
+      code = 0xc0 + v - 280;
+      bits = 8;
+    }
+    t->lit_code[v] = (uint16_t)bit_reverse(code, bits);
+    t->lit_bits[v] = (uint8_t)bits;
+  }
+  for (int i = 0, len = 3; len <= 258; len++) {
+    while (i < 28 && DEFLATE_LEN_BASE[i + 1] <= len)
+      i++;
+    t->len_sym[len] = (uint16_t)i;
+  }
+  for (int i = 0, dist = 1; dist <= (int)DEFLATE_WINDOW; dist++) {
+    while (i < 29 && DEFLATE_DIST_BASE[i + 1] <= dist)
+      i++;
+    t->dist_code[dist] = (uint8_t)i;
+  }
+}
+#endif
+
+// LSB first bit writer over a Buf.
+struct BitWriter {
+  struct Buf buf;
+  uint64_t bits;
+  int count;
+};
+
+static void bits_put(struct BitWriter *w, uint32_t value, int n) {
+  w->bits |= (uint64_t)value << w->count;
+  w->count += n;
+  if (w->count >= 32) {
+    uint8_t bytes[4] = {(uint8_t)w->bits, (uint8_t)(w->bits >> 8),
+                        (uint8_t)(w->bits >> 16), (uint8_t)(w->bits >> 24)};
+    buf_put(&w->buf, bytes, 4);
+    w->bits >>= 32;
+    w->count -= 32;
+  }
+}
+
+static void bits_align(struct BitWriter *w) {
+  while (w->count > 0) {
+    buf_byte(&w->buf, (uint8_t)w->bits);
+    w->bits >>= 8;
+    w->count = w->count > 8 ? w->count - 8 : 0;
+  }
+  w->bits = 0;
+}
+
+// Scratch space of a deflate compressor, reused across calls.
+struct Deflater {
+  int32_t head[DEFLATE_HASH_SIZE];
+  int32_t prev[DEFLATE_WINDOW];
+};
+
+#ifndef GLOBE_ZLIB
+// Hash of the three bytes at p.
+static uint32_t deflate_hash(const uint8_t *p) {
+  uint32_t v = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+  return v * 2654435761u >> (32 - DEFLATE_HASH_BITS);
+}
+
+// Compress in as a single fixed Huffman block with greedy LZ77 matching,
+// following up to level * 2 hash chain candidates per position, like stb.
+// Unless final, the block is followed by an empty stored block, which byte
+// aligns the output so independently compressed pieces can be concatenated
+// into one stream (a zlib sync flush).
+static void deflate_block(struct Deflater *d, const uint8_t *in, size_t n,
+                          int level, int final, struct BitWriter *w) {
+  pthread_once(&deflate_tables_once, deflate_tables_init);
+  const struct DeflateTables *t = &deflate_tables;
+  int max_chain = level * 2;
+
+  for (size_t h = 0; h < DEFLATE_HASH_SIZE; h++)
+    d->head[h] = -1;
+
+  bits_put(w, final ? 1 : 0, 1);
+  bits_put(w, 1, 2);
+  size_t i = 0;
+  while (i + 3 <= n) {
+    uint32_t h = deflate_hash(in + i);
+    size_t best_len = 0;
+    size_t best_dist = 0;
+    size_t max_len = n - i < 258 ? n - i : 258;
+    int32_t cand = d->head[h];
+    for (int chain = max_chain; cand >= 0 && chain > 0; chain--) {
+      size_t dist = i - (size_t)cand;
+      if (dist > DEFLATE_WINDOW)
+        break;
+      if (in[cand + best_len] == in[i + best_len]) {
+        size_t len = 0;
+        while (len < max_len && in[cand + len] == in[i + len])
+          len++;
+        if (len > best_len) {
+          best_len = len;
+          best_dist = dist;
+          if (len == max_len)
+            break;
+        }
+      }
+      cand = d->prev[cand & (DEFLATE_WINDOW - 1)];
+    }
+
+    size_t advance = 1;
+    if (best_len >= 3) {
+      int ls = t->len_sym[best_len];
+      bits_put(w, t->lit_code[257 + ls], t->lit_bits[257 + ls]);
+      bits_put(w, (uint32_t)(best_len - DEFLATE_LEN_BASE[ls]),
+               DEFLATE_LEN_EXTRA[ls]);
+      int dc = t->dist_code[best_dist];
+      bits_put(w, bit_reverse(dc, 5), 5);
+      bits_put(w, (uint32_t)(best_dist - DEFLATE_DIST_BASE[dc]),
+               DEFLATE_DIST_EXTRA[dc]);
+      advance = best_len;
+    } else {
+      bits_put(w, t->lit_code[in[i]], t->lit_bits[in[i]]);
+    }
+
+    // Insert every position covered into the hash chains.
+    for (size_t end = i + advance; i < end; i++) {
+      if (i + 3 > n)
+        continue;
+      uint32_t hi = deflate_hash(in + i);
+      d->prev[i & (DEFLATE_WINDOW - 1)] = d->head[hi];
+      d->head[hi] = (int32_t)i;
+    }
+  }
+  for (; i < n; i++)
+    bits_put(w, t->lit_code[in[i]], t->lit_bits[in[i]]);
+  bits_put(w, t->lit_code[256], t->lit_bits[256]);
+
+  if (!final) {
+    bits_put(w, 0, 3);
+    bits_align(w);
+    const uint8_t sync[4] = {0x00, 0x00, 0xff, 0xff};
+    buf_put(&w->buf, sync, sizeof(sync));
+  } else {
+    bits_align(w);
+  }
+}
+#endif
+
+// Store in without compression, for level 0. The last stored block doubles
+// as the sync flush, or is marked final.
+static void deflate_stored(const uint8_t *in, size_t n, int final,
+                           struct BitWriter *w) {
+  do {
+    size_t len = n < 65535 ? n : 65535;
+    n -= len;
+    bits_put(w, final && n == 0 ? 1 : 0, 1);
+    bits_put(w, 0, 2);
+    bits_align(w);
+    uint8_t head[4] = {(uint8_t)len, (uint8_t)(len >> 8), (uint8_t)~len,
+                       (uint8_t)(~len >> 8)};
+    buf_put(&w->buf, head, sizeof(head));
+    buf_put(&w->buf, in, len);
+    in += len;
+  } while (n > 0);
+}
+
+#ifdef GLOBE_ZLIB
+// Compress in with zlib's deflate, which builds dynamic Huffman codes and
+// matches lazily, ending with a sync flush unless final.
+static void deflate_zlib(const uint8_t *in, size_t n, int level, int final,
+                         struct BitWriter *w) {
+  z_stream z = {0};
+  if (deflateInit2(&z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) !=
+      Z_OK) {
+    w->buf.failed = 1;
+    return;
+  }
+  z.next_in = (uint8_t *)in;
+  z.avail_in = (uInt)n;
+  int flush = final ? Z_FINISH : Z_SYNC_FLUSH;
+  int status;
+  do {
+    uint8_t out[65536];
+    z.next_out = out;
+    z.avail_out = sizeof(out);
+    status = deflate(&z, flush);
+    buf_put(&w->buf, out, sizeof(out) - z.avail_out);
+  } while (status == Z_OK && (z.avail_out == 0 || z.avail_in > 0));
+  if (status == Z_STREAM_ERROR || (final && status != Z_STREAM_END))
+    w->buf.failed = 1;
+  deflateEnd(&z);
+}
+#endif
+
+// Compress in at level 0 to 9 with the backend picked at build time.
+static void deflate_data(struct Deflater *d, const uint8_t *in, size_t n,
+                         int level, int final, struct BitWriter *w) {
+  if (level == 0) {
+    deflate_stored(in, n, final, w);
+    return;
+  }
+#ifdef GLOBE_ZLIB
+  (void)d;
+  deflate_zlib(in, n, level, final, w);
+#else
+  deflate_block(d, in, n, level, final, w);
+#endif
+}
+
+// Paeth predictor of x from its left (a), upper (b) and upper left (c)
+// neighbours, written without branches on p so the loop vectorizes.
+static uint8_t paeth(int a, int b, int c) {
+  int pa = abs(b - c);
+  int pb = abs(a - c);
+  int pc = abs(a + b - 2 * c);
+  return (uint8_t)(pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+}
+
+// Filter one RGB row with filter type, prev being the row above or NULL.
+// Each type is its own loop over the row so the compiler can vectorize it.
+static void png_filter(int type, const uint8_t *row, const uint8_t *prev,
+                       size_t len, uint8_t *out) {
+  size_t i;
+  if (prev == NULL) {
+    // Above the first row is all zeros: up is none, paeth is sub.
+    type = type == 2 ? 0 : type == 4 ? 1 : type;
+    if (type == 3) {
+      for (i = 0; i < 3 && i < len; i++)
+        out[i] = row[i];
+      for (; i < len; i++)
+        out[i] = (uint8_t)(row[i] - (row[i - 3] >> 1));
+      return;
+    }
+  }
+  switch (type) {
+  case 0:
+    memcpy(out, row, len);
+    break;
+  case 1:
+    for (i = 0; i < 3 && i < len; i++)
+      out[i] = row[i];
+    for (; i < len; i++)
+      out[i] = (uint8_t)(row[i] - row[i - 3]);
+    break;
+  case 2:
+    for (i = 0; i < len; i++)
+      out[i] = (uint8_t)(row[i] - prev[i]);
+    break;
+  case 3:
+    for (i = 0; i < 3 && i < len; i++)
+      out[i] = (uint8_t)(row[i] - (prev[i] >> 1));
+    for (; i < len; i++)
+      out[i] = (uint8_t)(row[i] - ((row[i - 3] + prev[i]) >> 1));
+    break;
+  case 4:
+    for (i = 0; i < 3 && i < len; i++)
+      out[i] = (uint8_t)(row[i] - prev[i]);
+    for (; i < len; i++)
+      out[i] = (uint8_t)(row[i] - paeth(row[i - 3], prev[i], prev[i - 3]));
+    break;
+  }
+}
+
+// Filter a row with the type whose output has the smallest sum of absolute
+// values, the usual estimate of what compresses best. out gets the filter
+// type byte followed by the filtered row.
+static void png_filter_row(const uint8_t *row, const uint8_t *prev, size_t len,
+                           uint8_t *out, uint8_t *scratch) {
+  uint64_t best_est = UINT64_MAX;
+  int best = 0;
+  for (int type = 0; type < 5; type++) {
+    png_filter(type, row, prev, len, scratch);
+    uint64_t est = 0;
+    for (size_t i = 0; i < len; i++)
+      est += abs((int8_t)scratch[i]);
+    if (est < best_est) {
+      best_est = est;
+      best = type;
+    }
+  }
+  out[0] = (uint8_t)best;
+  png_filter(best, row, prev, len, out + 1);
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t)(v >> 24);
+  p[1] = (uint8_t)(v >> 16);
+  p[2] = (uint8_t)(v >> 8);
+  p[3] = (uint8_t)v;
+}
+
+// Write a complete PNG chunk to fd, or append it to mem if not NULL.
+static int png_write_chunk(int fd, struct Buf *mem, const char *type,
+                           const uint8_t *data, size_t len) {
+  uint8_t head[8];
+  uint8_t tail[4];
+  put_be32(head, (uint32_t)len);
+  memcpy(head + 4, type, 4);
+  put_be32(tail, crc_update(crc_update(0, head + 4, 4), data, len));
+  if (mem != NULL) {
+    buf_put(mem, head, sizeof(head));
+    buf_put(mem, data, len);
+    buf_put(mem, tail, sizeof(tail));
+    return mem->failed;
+  }
+  if (write_full(fd, head, sizeof(head)) != 0 ||
+      write_full(fd, data, len) != 0 || write_full(fd, tail, sizeof(tail)) != 0)
+    return 1;
+  return 0;
+}
+
+// Fills rgb with rows [y0, y1) of an image, returns non-zero on failure.
+typedef int (*PngRows)(void *src, size_t y0, size_t y1, uint8_t *rgb);
+
+// Shared state for PNG strip workers.
+struct PngJob {
+  PngRows read_rows;
+  void *src;
+  size_t width;
+  size_t height;
+  size_t rows_per_strip;
+  size_t num_strips;
+  int level;
+  int fd;
+  struct Buf *mem;
+  pthread_mutex_t lock;
+  pthread_cond_t turn;
+  size_t next_strip;
+  size_t next_write;
+  uint32_t adler;
+  int failed;
+};
+
+// Workers filter and deflate strips of rows independently, then take turns
+// writing them in order as IDAT chunks, chaining the Adler-32 as they go.
+static void *png_worker(void *arg) {
+  struct PngJob *job = arg;
+  size_t row_bytes = job->width * 3;
+  size_t strip_bytes = job->rows_per_strip * (row_bytes + 1);
+
+  uint8_t *rgb = malloc((job->rows_per_strip + 1) * row_bytes);
+  uint8_t *filtered = malloc(strip_bytes);
+  uint8_t *scratch = malloc(row_bytes);
+  struct Deflater *deflater = malloc(sizeof(struct Deflater));
+  struct BitWriter w = {{NULL, 0, 0, 0}, 0, 0};
+  int failed = rgb == NULL || filtered == NULL || scratch == NULL ||
+               deflater == NULL;
+  if (failed)
+    perror("png malloc");
+
+  for (;;) {
+    // Claim the next strip.
+    pthread_mutex_lock(&job->lock);
+    size_t strip = job->next_strip++;
+    int done = strip >= job->num_strips || job->failed || failed;
+    pthread_mutex_unlock(&job->lock);
+    if (done)
+      break;
+
+    // Produce the strip's rows. The first row of a strip still filters
+    // against the last row of the previous strip, so that row is produced
+    // again; only the deflate state is independent.
+    size_t y0 = strip * job->rows_per_strip;
+    size_t y1 = y0 + job->rows_per_strip < job->height
+                    ? y0 + job->rows_per_strip
+                    : job->height;
+    size_t first = y0 > 0 ? y0 - 1 : 0;
+    if (job->read_rows(job->src, first, y1, rgb) != 0) {
+      failed = 1;
+      break;
+    }
+
+    // Filter rows.
+    const uint8_t *strip_rgb = rgb + (y0 - first) * row_bytes;
+    for (size_t y = y0; y < y1; y++) {
+      const uint8_t *row = strip_rgb + (y - y0) * row_bytes;
+      const uint8_t *prev = y > 0 ? row - row_bytes : NULL;
+      png_filter_row(row, prev, row_bytes,
+                     filtered + (y - y0) * (row_bytes + 1), scratch);
+    }
+    size_t len = (y1 - y0) * (row_bytes + 1);
+    uint32_t adler = adler_update(1, filtered, len);
+
+    // Deflate. The first strip carries the zlib header.
+    int last = strip == job->num_strips - 1;
+    w.buf.len = 0;
+    if (strip == 0) {
+      const uint8_t zlib_header[2] = {0x78, 0x5e};
+      buf_put(&w.buf, zlib_header, sizeof(zlib_header));
+    }
+    deflate_data(deflater, filtered, len, job->level, last, &w);
+
+    // Wait for the previous strip to be written, then write this one.
+    pthread_mutex_lock(&job->lock);
+    while (job->next_write != strip && !job->failed)
+      pthread_cond_wait(&job->turn, &job->lock);
+    done = job->failed;
+    pthread_mutex_unlock(&job->lock);
+    if (done)
+      break;
+    job->adler = strip == 0 ? adler : adler_combine(job->adler, adler, len);
+    if (last) {
+      uint8_t trailer[4];
+      put_be32(trailer, job->adler);
+      buf_put(&w.buf, trailer, sizeof(trailer));
+    }
+    failed = w.buf.failed ||
+             png_write_chunk(job->fd, job->mem, "IDAT", w.buf.data,
+                             w.buf.len) != 0;
+    pthread_mutex_lock(&job->lock);
+    job->next_write++;
+    pthread_cond_broadcast(&job->turn);
+    pthread_mutex_unlock(&job->lock);
+    if (failed)
+      break;
+  }
+
+  if (failed) {
+    pthread_mutex_lock(&job->lock);
+    job->failed = 1;
+    pthread_cond_broadcast(&job->turn);
+    pthread_mutex_unlock(&job->lock);
+  }
+  free(rgb);
+  free(filtered);
+  free(scratch);
+  free(deflater);
+  free(w.buf.data);
+  return NULL;
+}
+
+// Encode an 8 bit RGB image as a PNG to fd, or to mem if not NULL, encoding
+// strips of rows in parallel. Rows are pulled from read_rows one strip at a
+// time, so memory use depends on the width and thread count, never on the
+// height. Strip boundaries depend only on the width, so the output is the
+// same for any number of threads.
+static int png_encode(int fd, struct Buf *mem, PngRows read_rows, void *src,
+                      size_t width, size_t height, int level,
+                      size_t num_threads) {
+  size_t rows_per_strip = PNG_STRIP_BYTES / (width * 3 + 1);
+  if (rows_per_strip == 0)
+    rows_per_strip = 1;
+
+  // Signature and header.
+  const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+  uint8_t ihdr[13] = {0};
+  put_be32(ihdr, (uint32_t)width);
+  put_be32(ihdr + 4, (uint32_t)height);
+  ihdr[8] = 8; // bit depth
+  ihdr[9] = 2; // RGB
+  int failed;
+  if (mem != NULL) {
+    buf_put(mem, signature, sizeof(signature));
+    failed = mem->failed;
+  } else {
+    failed = write_full(fd, signature, sizeof(signature)) != 0;
+  }
+  failed = failed || png_write_chunk(fd, mem, "IHDR", ihdr, sizeof(ihdr)) != 0;
+
+  // Image data.
+  struct PngJob job = {read_rows,
+                       src,
+                       width,
+                       height,
+                       rows_per_strip,
+                       (height + rows_per_strip - 1) / rows_per_strip,
+                       level,
+                       fd,
+                       mem,
+                       PTHREAD_MUTEX_INITIALIZER,
+                       PTHREAD_COND_INITIALIZER,
+                       0,
+                       0,
+                       1,
+                       0};
+  if (!failed) {
+    run_workers(png_worker, &job, num_threads);
+    failed = job.failed;
+  }
+
+  // End.
+  if (!failed)
+    failed = png_write_chunk(fd, mem, "IEND", NULL, 0);
+  return failed;
+}
+
+// Write an 8 bit RGB image to a PNG file, see png_encode.
+static int png_write(char *out_file, PngRows read_rows, void *src, size_t width,
+                     size_t height, int level, size_t num_threads) {
+  int fd;
+  if ((fd = open(out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+    perror("open");
+    return 1;
+  }
+  int failed = png_encode(fd, NULL, read_rows, src, width, height, level,
+                          num_threads);
+  if (close(fd) == -1) {
+    perror("close");
+    failed = 1;
+  }
+  if (failed)
+    unlink(out_file);
+
+  return failed;
+}
+
+// Overview sidecar: levels 1, 2, ... of the globe downsampled 2x, 4x, ...
+// each as min, max and mean planes, int16 row-major. A level cell covers
+// the 2^k x 2^k block of globe cells at the same index shifted left by k;
+// NO_DATA cells are ignored and blocks with no data are NO_DATA. The header
+// is written last, so a partial file is never taken for a valid one.
+struct OverviewLevel {
+  uint32_t cols;
+  uint32_t rows;
+  uint64_t offset;
+};
+
+// source_size and source_mtime_ns are those of the globe the overviews were
+// built from, so a sidecar left over from an earlier merge isn't used.
+struct OverviewHeader {
+  char magic[8];
+  uint32_t num_levels;
+  uint32_t reserved;
+  uint64_t source_size;
+  int64_t source_mtime_ns;
+  struct OverviewLevel levels[OVERVIEW_MAX_LEVELS];
+};
+
+enum OverviewPlane { OVERVIEW_MIN, OVERVIEW_MAX, OVERVIEW_MEAN };
+
+struct Overview {
+  int fd;
+  struct OverviewHeader header;
+};
+
+// Levels get coarser until they would be narrower than OVERVIEW_MIN_COLS.
+static void overview_layout(struct OverviewHeader *header) {
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, OVERVIEW_MAGIC, sizeof(header->magic));
+  uint64_t offset = sizeof(*header);
+  for (int k = 1; k <= OVERVIEW_MAX_LEVELS; k++) {
+    size_t scale = (size_t)1 << k;
+    size_t cols = (GLOBE_COLS + scale - 1) / scale;
+    size_t rows = (GLOBE_ROWS + scale - 1) / scale;
+    if (cols < OVERVIEW_MIN_COLS)
+      break;
+    struct OverviewLevel *level = &header->levels[header->num_levels++];
+    level->cols = (uint32_t)cols;
+    level->rows = (uint32_t)rows;
+    level->offset = offset;
+    offset += (uint64_t)OVERVIEW_PLANES * cols * rows * sizeof(int16_t);
+  }
+}
+
+static off_t overview_plane_offset(const struct OverviewLevel *level,
+                                   enum OverviewPlane plane) {
+  return (off_t)(level->offset +
+                 (uint64_t)plane * level->cols * level->rows * sizeof(int16_t));
+}
+
+static void overview_path(const char *in_file, char *path, size_t size) {
+  snprintf(path, size, "%s.ovr", in_file);
+}
+
+// Record the size and modification time of the globe at in_file in header.
+static int overview_source(struct OverviewHeader *header, const char *in_file) {
+  struct stat st;
+  if (stat(in_file, &st) == -1) {
+    perror("stat");
+    return 1;
+  }
+  header->source_size = (uint64_t)st.st_size;
+  header->source_mtime_ns =
+      (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  return 0;
+}
+
+// Open the overview sidecar at path. Returns 1 if it is missing, was not
+// built for this layout, or was built from another version of in_file.
+static int overview_open(struct Overview *ov, const char *path,
+                         const char *in_file) {
+  struct OverviewHeader expected;
+  overview_layout(&expected);
+  if ((ov->fd = open(path, O_RDONLY)) == -1)
+    return 1;
+  int valid = pread_full(ov->fd, &ov->header, sizeof(ov->header), 0) == 0;
+  if (valid) {
+    expected.source_size = ov->header.source_size;
+    expected.source_mtime_ns = ov->header.source_mtime_ns;
+    valid = memcmp(&ov->header, &expected, sizeof(expected)) == 0;
+    if (!valid)
+      fprintf(stderr, "%s: not a valid overview file.\n", path);
+  }
+  if (valid && overview_source(&expected, in_file) == 0 &&
+      (expected.source_size != ov->header.source_size ||
+       expected.source_mtime_ns != ov->header.source_mtime_ns)) {
+    fprintf(stderr, "%s: built from another version of %s, ignoring it.\n",
+            path, in_file);
+    valid = 0;
+  }
+  if (!valid) {
+    close(ov->fd);
+    ov->fd = -1;
+    return 1;
+  }
+  return 0;
+}
+
+static void overview_close(struct Overview *ov) {
+  if (ov->fd != -1)
+    close(ov->fd);
+  ov->fd = -1;
+}
+
+// Window of level k (1 based) covering a globe window.
+static struct Window overview_window(struct Window win, int k) {
+  size_t scale = (size_t)1 << k;
+  struct Window out = {win.minx / scale, win.miny / scale,
+                       (win.maxx + scale - 1) / scale,
+                       (win.maxy + scale - 1) / scale};
+  return out;
+}
+
+// Running min, max, sum and count per cell of one row of a level.
+struct OverviewAcc {
+  int16_t *min;
+  int16_t *max;
+  int64_t *sum;
+  uint32_t *count;
+};
+
+static void overview_acc_reset(struct OverviewAcc *acc, size_t cols) {
+  for (size_t x = 0; x < cols; x++) {
+    acc->min[x] = INT16_MAX;
+    acc->max[x] = INT16_MIN;
+    acc->sum[x] = 0;
+    acc->count[x] = 0;
+  }
+}
+
+static int overview_acc_init(struct OverviewAcc *acc, size_t cols) {
+  acc->min = malloc(cols * sizeof(int16_t));
+  acc->max = malloc(cols * sizeof(int16_t));
+  acc->sum = malloc(cols * sizeof(int64_t));
+  acc->count = malloc(cols * sizeof(uint32_t));
+  if (acc->min == NULL || acc->max == NULL || acc->sum == NULL ||
+      acc->count == NULL) {
+    perror("overview malloc");
+    return 1;
+  }
+  overview_acc_reset(acc, cols);
+  return 0;
+}
+
+static void overview_acc_free(struct OverviewAcc *acc) {
+  free(acc->min);
+  free(acc->max);
+  free(acc->sum);
+  free(acc->count);
+}
+
+// Fold cell x of src into cell x >> shift of dst.
+static void overview_acc_fold(const struct OverviewAcc *src, size_t n,
+                              int shift, struct OverviewAcc *dst) {
+  for (size_t x = 0; x < n; x++) {
+    size_t d = x >> shift;
+    if (src->min[x] < dst->min[d])
+      dst->min[d] = src->min[x];
+    if (src->max[x] > dst->max[d])
+      dst->max[d] = src->max[x];
+    dst->sum[d] += src->sum[x];
+    dst->count[d] += src->count[x];
+  }
+}
+
+// Write the accumulated row y of a level and reset the accumulator.
+static int overview_flush(int fd, const struct OverviewLevel *level, size_t y,
+                          struct OverviewAcc *acc, int16_t *row) {
+  size_t cols = level->cols;
+  off_t offset = (off_t)(y * cols * sizeof(int16_t));
+  for (size_t x = 0; x < cols; x++)
+    row[x] = acc->count[x] ? acc->min[x] : NO_DATA;
+  if (pwrite_full(fd, row, cols * sizeof(int16_t),
+                  overview_plane_offset(level, OVERVIEW_MIN) + offset) != 0)
+    return 1;
+  for (size_t x = 0; x < cols; x++)
+    row[x] = acc->count[x] ? acc->max[x] : NO_DATA;
+  if (pwrite_full(fd, row, cols * sizeof(int16_t),
+                  overview_plane_offset(level, OVERVIEW_MAX) + offset) != 0)
+    return 1;
+  for (size_t x = 0; x < cols; x++)
+    row[x] = acc->count[x] ? (int16_t)(acc->sum[x] / acc->count[x]) : NO_DATA;
+  if (pwrite_full(fd, row, cols * sizeof(int16_t),
+                  overview_plane_offset(level, OVERVIEW_MEAN) + offset) != 0)
+    return 1;
+  overview_acc_reset(acc, cols);
+  return 0;
+}
+
+// Build every overview level in one sequential pass over the globe. Each
+// globe row is halved horizontally level by level into row, and each
+// level's halved row is folded into that level's accumulator, which is
+// written out once 2^k globe rows have gone in.
+static int overviews(char *in_file, char *out_file) {
+  struct OverviewHeader header;
+  overview_layout(&header);
+  if (overview_source(&header, in_file) != 0)
+    return 1;
+  int num_levels = (int)header.num_levels;
+
+  struct Globe globe;
+  if (globe_open(&globe, in_file, MADV_SEQUENTIAL) != 0)
+    return 1;
+
+  int fd;
+  if ((fd = open(out_file, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+    perror("open");
+    globe_close(&globe);
+    return 1;
+  }
+
+  // row[k] holds the current globe row at level k's width, acc[k] the
+  // level's accumulated rows. row[0] is the globe row itself.
+  struct OverviewAcc row[OVERVIEW_MAX_LEVELS + 1] = {0};
+  struct OverviewAcc acc[OVERVIEW_MAX_LEVELS + 1] = {0};
+  int16_t *out_row = malloc(GLOBE_COLS / 2 * sizeof(int16_t));
+  int16_t *cells = malloc(GLOBE_COLS * sizeof(int16_t));
+  int failed = out_row == NULL || cells == NULL;
+  if (failed)
+    perror("overview malloc");
+  for (int k = 0; k <= num_levels && !failed; k++) {
+    size_t cols = k == 0 ? GLOBE_COLS : header.levels[k - 1].cols;
+    failed = overview_acc_init(&row[k], cols) != 0 ||
+             (k > 0 && overview_acc_init(&acc[k], cols) != 0);
+  }
+
+  for (size_t y = 0; y < GLOBE_ROWS && !failed; y++) {
+    const int16_t *src = globe_row(&globe, y, 0, GLOBE_COLS, cells);
+    if (src == NULL) {
+      failed = 1;
+      break;
+    }
+    for (size_t x = 0; x < GLOBE_COLS; x++) {
+      int has_data = src[x] != NO_DATA;
+      row[0].min[x] = has_data ? src[x] : INT16_MAX;
+      row[0].max[x] = has_data ? src[x] : INT16_MIN;
+      row[0].sum[x] = has_data ? src[x] : 0;
+      row[0].count[x] = (uint32_t)has_data;
+    }
+    for (int k = 1; k <= num_levels && !failed; k++) {
+      const struct OverviewLevel *level = &header.levels[k - 1];
+      size_t src_cols = k == 1 ? GLOBE_COLS : header.levels[k - 2].cols;
+      overview_acc_reset(&row[k], level->cols);
+      overview_acc_fold(&row[k - 1], src_cols, 1, &row[k]);
+      overview_acc_fold(&row[k], level->cols, 0, &acc[k]);
+      size_t scale = (size_t)1 << k;
+      if ((y + 1) % scale == 0 || y + 1 == GLOBE_ROWS)
+        failed = overview_flush(fd, level, y / scale, &acc[k], out_row);
+    }
+  }
+
+  // Header last.
+  if (!failed)
+    failed = pwrite_full(fd, &header, sizeof(header), 0);
+  if (close(fd) == -1) {
+    perror("close");
+    failed = 1;
+  }
+  if (failed)
+    unlink(out_file);
+
+  for (int k = 0; k <= num_levels; k++) {
+    overview_acc_free(&row[k]);
+    overview_acc_free(&acc[k]);
+  }
+  free(out_row);
+  free(cells);
+  globe_close(&globe);
+
+  return failed;
+}
+
+// Resampling weights along one axis. Output index o is the weighted average
+// of source indices first[o] .. first[o] + taps[o] - 1, with weights
+// weight[o * max_taps] onwards.
+struct ResampleAxis {
+  size_t *first;
+  size_t *taps;
+  float *weight;
+  size_t max_taps;
+};
+
+// Output index o covers source coordinates [origin + o * ratio,
+// origin + (o + 1) * ratio), source index i covering [i, i + 1).
+static int resample_axis_init(struct ResampleAxis *axis, enum Resampling mode,
+                              double origin, double ratio, size_t src_len,
+                              size_t out_len) {
+  axis->max_taps = mode == RESAMPLE_BOX      ? (size_t)ceil(ratio) + 1
+                   : mode == RESAMPLE_BILINEAR ? 2
+                                               : 1;
+  axis->first = malloc(out_len * sizeof(size_t));
+  axis->taps = malloc(out_len * sizeof(size_t));
+  axis->weight = malloc(out_len * axis->max_taps * sizeof(float));
+  if (axis->first == NULL || axis->taps == NULL || axis->weight == NULL) {
+    perror("resample malloc");
+    return 1;
+  }
+
+  for (size_t o = 0; o < out_len; o++) {
+    float *w = axis->weight + o * axis->max_taps;
+    double lo = origin + o * ratio;
+    double center = lo + ratio / 2;
+    long i = (long)floor(center);
+    axis->first[o] = i < 0 ? 0 : (size_t)i < src_len ? (size_t)i : src_len - 1;
+    axis->taps[o] = 1;
+    w[0] = 1;
+
+    if (mode == RESAMPLE_BOX) {
+      // Each source cell weighs as much as it overlaps the output pixel.
+      double hi = lo + ratio;
+      long i0 = (long)floor(lo) > 0 ? (long)floor(lo) : 0;
+      long i1 = (long)ceil(hi) < (long)src_len ? (long)ceil(hi) : (long)src_len;
+      if (i0 < i1 && (size_t)(i1 - i0) <= axis->max_taps) {
+        axis->first[o] = (size_t)i0;
+        axis->taps[o] = (size_t)(i1 - i0);
+        for (long j = i0; j < i1; j++)
+          w[j - i0] = (float)(fmin(hi, j + 1.0) - fmax(lo, (double)j));
+      }
+    } else if (mode == RESAMPLE_BILINEAR) {
+      // Interpolate between the two cell centers around the pixel center.
+      double c = center - 0.5;
+      long j = (long)floor(c);
+      float f = (float)(c - j);
+      if (j >= 0 && (size_t)j + 1 < src_len) {
+        axis->first[o] = (size_t)j;
+        axis->taps[o] = 2;
+        w[0] = 1 - f;
+        w[1] = f;
+      }
+    }
+  }
+  return 0;
+}
+
+static void resample_axis_free(struct ResampleAxis *axis) {
+  free(axis->first);
+  free(axis->taps);
+  free(axis->weight);
+}
+
+// Add weight * cell over some source rows of one output row to sum, per
+// column. NO_DATA cells add nothing, including to the weight, so they drop
+// out of the average instead of pulling it down.
+static void resample_vertical(const int16_t *cells, size_t width, size_t rows,
+                              const float *weight, float *sum, float *wsum) {
+  for (size_t r = 0; r < rows; r++) {
+    const int16_t *row = cells + r * width;
+    float w = weight[r];
+    for (size_t x = 0; x < width; x++) {
+      float valid = row[x] != NO_DATA ? w : 0;
+      sum[x] += valid * row[x];
+      wsum[x] += valid;
+    }
+  }
+}
+
+// Combine the columns of one output row and divide out the weights.
+static void resample_horizontal(const struct ResampleAxis *axis,
+                                const float *sum, const float *wsum,
+                                size_t out_width, int16_t *out) {
+  for (size_t o = 0; o < out_width; o++) {
+    const float *w = axis->weight + o * axis->max_taps;
+    size_t first = axis->first[o];
+    float s = 0;
+    float ws = 0;
+    for (size_t t = 0; t < axis->taps[o]; t++) {
+      s += w[t] * sum[first + t];
+      ws += w[t] * wsum[first + t];
+    }
+    out[o] = ws > 0 ? (int16_t)lrintf(s / ws) : NO_DATA;
+  }
+}
+
+// Hillshading: light from azimuth (degrees clockwise from north) at altitude
+// degrees above the horizon, on a surface with heights scaled by z_factor.
+// Output row y spans latitudes north - y * cell_y down by cell_y, and cells
+// are cell_x degrees wide, which in meters shrinks with the latitude.
+struct Hillshade {
+  enum Shading mode;
+  float sin_alt;
+  float light_x;
+  float light_y;
+  double z_factor;
+  double north;
+  double cell_x;
+  double cell_y;
+  uint16_t blend[256];
+};
+
+static void hillshade_init(struct Hillshade *hs, enum Shading mode,
+                           double azimuth, double altitude, double z_factor) {
+  double rad = M_PI / 180;
+  hs->mode = mode;
+  hs->sin_alt = (float)sin(altitude * rad);
+  hs->light_x = (float)(sin(azimuth * rad) * cos(altitude * rad));
+  hs->light_y = (float)(cos(azimuth * rad) * cos(altitude * rad));
+  hs->z_factor = z_factor;
+  hs->north = 90;
+  hs->cell_x = CELL_DEG;
+  hs->cell_y = CELL_DEG;
+
+  // Blending scales palette colors by the shade relative to flat ground, so
+  // flat cells keep their color, slopes facing away darken and slopes facing
+  // the light brighten, in 8.8 fixed point.
+  for (int s = 0; s < 256; s++) {
+    double scale = s / 255.0 / hs->sin_alt;
+    hs->blend[s] = (uint16_t)lrint(256 * fmin(scale, HILLSHADE_BLEND_MAX));
+  }
+}
+
+// East and north gradients of the center of a 3x3 neighborhood, by Horn's
+// method: both weigh the middle row or column twice. kx and ky scale the
+// height differences to slopes. Neighbors without data take the center's
+// height.
+static void horn_gradient(const int16_t *up, const int16_t *mid,
+                          const int16_t *down, float kx, float ky, float *p,
+                          float *q) {
+  float e = mid[1];
+  float a = up[0] != NO_DATA ? up[0] : e;
+  float b = up[1] != NO_DATA ? up[1] : e;
+  float c = up[2] != NO_DATA ? up[2] : e;
+  float d = mid[0] != NO_DATA ? mid[0] : e;
+  float f = mid[2] != NO_DATA ? mid[2] : e;
+  float g = down[0] != NO_DATA ? down[0] : e;
+  float h = down[1] != NO_DATA ? down[1] : e;
+  float i = down[2] != NO_DATA ? down[2] : e;
+  *p = kx * ((c + 2 * f + i) - (a + 2 * d + g));
+  *q = ky * ((a + 2 * b + c) - (g + 2 * h + i));
+}
+
+// Scales from height differences in the stencil of row y to slopes: meters
+// per cell along the parallel through the row center and along the
+// meridian, folded with the z factor and Horn's 1/8.
+static void horn_scales(double north, double cell_x, double cell_y,
+                        double z_factor, size_t y, float *kx, float *ky) {
+  double lat = north - ((double)y + 0.5) * cell_y;
+  double meters = M_PI / 180 * EARTH_RADIUS_M;
+  double dx = fmax(cell_x * meters * cos(lat * M_PI / 180), 1e-3);
+  *kx = (float)(z_factor / (8 * dx));
+  *ky = (float)(z_factor / (8 * cell_y * meters));
+}
+
+static uint8_t hillshade_cell(const struct Hillshade *hs, const int16_t *up,
+                              const int16_t *mid, const int16_t *down, float kx,
+                              float ky) {
+  float p, q;
+  horn_gradient(up, mid, down, kx, ky, &p, &q);
+  float dot = (hs->sin_alt - p * hs->light_x - q * hs->light_y) /
+              sqrtf(1 + p * p + q * q);
+  return (uint8_t)((dot > 0 ? dot : 0) * 255 + 0.5f);
+}
+
+static void hillshade_row_scalar(const struct Hillshade *hs, const int16_t *up,
+                                 const int16_t *mid, const int16_t *down,
+                                 size_t n, float kx, float ky, uint8_t *shade) {
+  for (size_t x = 0; x < n; x++)
+    shade[x] = hillshade_cell(hs, up + x, mid + x, down + x, kx, ky);
+}
+
+#ifdef HAVE_X86
+// Widen 8 neighbors to floats, replacing NO_DATA with the center.
+static __attribute__((target("avx2"))) __m256
+horn_load(const int16_t *p, __m128i center) {
+  __m128i v = _mm_loadu_si128((const __m128i *)p);
+  __m128i missing = _mm_cmpeq_epi16(v, _mm_set1_epi16(NO_DATA));
+  v = _mm_blendv_epi8(v, center, missing);
+  return _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v));
+}
+
+// horn_gradient for 8 cells, with the same operations in the same order,
+// so kernels built on either give the same results.
+static __attribute__((target("avx2"))) void
+horn_gradient_avx2(const int16_t *up, const int16_t *mid, const int16_t *down,
+                   __m256 kx, __m256 ky, __m256 *p, __m256 *q) {
+  const __m256 two = _mm256_set1_ps(2);
+  __m128i center = _mm_loadu_si128((const __m128i *)(mid + 1));
+  __m256 a = horn_load(up, center);
+  __m256 b = horn_load(up + 1, center);
+  __m256 c = horn_load(up + 2, center);
+  __m256 d = horn_load(mid, center);
+  __m256 f = horn_load(mid + 2, center);
+  __m256 g = horn_load(down, center);
+  __m256 h = horn_load(down + 1, center);
+  __m256 i = horn_load(down + 2, center);
+  __m256 east = _mm256_add_ps(_mm256_add_ps(c, _mm256_mul_ps(two, f)), i);
+  __m256 west = _mm256_add_ps(_mm256_add_ps(a, _mm256_mul_ps(two, d)), g);
+  __m256 north = _mm256_add_ps(_mm256_add_ps(a, _mm256_mul_ps(two, b)), c);
+  __m256 south = _mm256_add_ps(_mm256_add_ps(g, _mm256_mul_ps(two, h)), i);
+  *p = _mm256_mul_ps(kx, _mm256_sub_ps(east, west));
+  *q = _mm256_mul_ps(ky, _mm256_sub_ps(north, south));
+}
+
+static __attribute__((target("avx2"))) void
+hillshade_row_avx2(const struct Hillshade *hs, const int16_t *up,
+                   const int16_t *mid, const int16_t *down, size_t n,
+                   float kx, float ky, uint8_t *shade) {
+  const __m256 vkx = _mm256_set1_ps(kx);
+  const __m256 vky = _mm256_set1_ps(ky);
+  const __m256 sin_alt = _mm256_set1_ps(hs->sin_alt);
+  const __m256 light_x = _mm256_set1_ps(hs->light_x);
+  const __m256 light_y = _mm256_set1_ps(hs->light_y);
+  const __m256 one = _mm256_set1_ps(1);
+  const __m256 full = _mm256_set1_ps(255);
+  const __m256 half = _mm256_set1_ps(0.5f);
+  size_t x = 0;
+  for (; x + 8 <= n; x += 8) {
+    __m256 p, q;
+    horn_gradient_avx2(up + x, mid + x, down + x, vkx, vky, &p, &q);
+    __m256 lit = _mm256_sub_ps(sin_alt, _mm256_mul_ps(p, light_x));
+    __m256 num = _mm256_sub_ps(lit, _mm256_mul_ps(q, light_y));
+    __m256 len = _mm256_sqrt_ps(_mm256_add_ps(
+        _mm256_add_ps(one, _mm256_mul_ps(p, p)), _mm256_mul_ps(q, q)));
+    __m256 dot = _mm256_max_ps(_mm256_div_ps(num, len), _mm256_setzero_ps());
+    __m256i s = _mm256_cvttps_epi32(
+        _mm256_add_ps(_mm256_mul_ps(dot, full), half));
+    __m128i s16 = _mm_packus_epi32(_mm256_castsi256_si128(s),
+                                   _mm256_extracti128_si256(s, 1));
+    _mm_storel_epi64((__m128i *)(shade + x), _mm_packus_epi16(s16, s16));
+  }
+  hillshade_row_scalar(hs, up + x, mid + x, down + x, n - x, kx, ky,
+                       shade + x);
+}
+#endif
+
+// Shade the n cells of row y, whose neighbors are the rows up, mid and down,
+// each holding n + 2 cells, one more on either side.
+static void hillshade_row(const struct Hillshade *hs, size_t y,
+                          const int16_t *up, const int16_t *mid,
+                          const int16_t *down, size_t n, uint8_t *shade) {
+  float kx, ky;
+  horn_scales(hs->north, hs->cell_x, hs->cell_y, hs->z_factor, y, &kx, &ky);
+#ifdef HAVE_X86
+  if (__builtin_cpu_supports("avx2")) {
+    hillshade_row_avx2(hs, up, mid, down, n, kx, ky, shade);
+    return;
+  }
+#endif
+  hillshade_row_scalar(hs, up, mid, down, n, kx, ky, shade);
+}
+
+// Color n cells from their shades: grey, or the palette color scaled by the
+// shade. Cells without data keep the palette's color.
+static void hillshade_colorize(const struct Hillshade *hs,
+                               const uint32_t *palette, const int16_t *cells,
+                               const uint8_t *shade, size_t n, uint8_t *rgb) {
+  for (size_t x = 0; x < n; x++) {
+    uint8_t color[4];
+    memcpy(color, &palette[(uint16_t)cells[x]], sizeof(color));
+    if (cells[x] != NO_DATA && hs->mode == SHADE_HILLSHADE) {
+      color[0] = color[1] = color[2] = shade[x];
+    } else if (cells[x] != NO_DATA) {
+      for (int k = 0; k < 3; k++) {
+        unsigned v = (unsigned)color[k] * hs->blend[shade[x]] >> 8;
+        color[k] = (uint8_t)(v < 255 ? v : 255);
+      }
+    }
+    memcpy(rgb + x * 3, color, 3);
+  }
+}
+
+// Source of render rows: cells of a window read from the globe or one of its
+// overview planes, optionally resampled, colorized through the palette and
+// optionally shaded.
+struct RenderRows {
+  struct Globe *globe;
+  int fd;
+  off_t offset;
+  size_t cols;
+  struct Window win;
+  const uint32_t *palette;
+  const struct ResampleAxis *xaxis;
+  const struct ResampleAxis *yaxis;
+  size_t out_width;
+  size_t out_height;
+  const struct Hillshade *shade;
+};
+
+// Read a window of the render source, the globe or an overview plane.
+static int render_read_window(struct RenderRows *src, struct Window win,
+                              int16_t *cells) {
+  if (src->globe != NULL)
+    return globe_read_window(src->globe, win, cells);
+  return raster_read_window(src->fd, src->offset, src->cols, win, cells);
+}
+
+// Buffers for resampling rows of src one at a time. cells holds up to
+// max_rows source rows, fewer than the taps of a row when downscaling a lot.
+struct RenderScratch {
+  float *sum;
+  float *wsum;
+  int16_t *cells;
+  size_t max_rows;
+};
+
+static int render_scratch_init(struct RenderScratch *scratch,
+                               const struct RenderRows *src) {
+  size_t width = src->win.maxx - src->win.minx;
+  scratch->max_rows = RENDER_SCRATCH_CELLS / width;
+  if (scratch->max_rows == 0)
+    scratch->max_rows = 1;
+  if (scratch->max_rows > src->yaxis->max_taps)
+    scratch->max_rows = src->yaxis->max_taps;
+  scratch->sum = malloc(width * sizeof(float));
+  scratch->wsum = malloc(width * sizeof(float));
+  scratch->cells = malloc(scratch->max_rows * width * sizeof(int16_t));
+  if (scratch->sum == NULL || scratch->wsum == NULL ||
+      scratch->cells == NULL) {
+    perror("render malloc");
+    return 1;
+  }
+  return 0;
+}
+
+static void render_scratch_free(struct RenderScratch *scratch) {
+  free(scratch->sum);
+  free(scratch->wsum);
+  free(scratch->cells);
+}
+
+// Resample output row y: read the source rows it needs, max_rows at a time,
+// average them per column, then combine columns.
+static int render_resampled_row(struct RenderRows *src,
+                                struct RenderScratch *scratch, size_t y,
+                                int16_t *out) {
+  const struct ResampleAxis *yaxis = src->yaxis;
+  size_t width = src->win.maxx - src->win.minx;
+  size_t first = src->win.miny + yaxis->first[y];
+  size_t taps = yaxis->taps[y];
+  const float *weight = yaxis->weight + y * yaxis->max_taps;
+  memset(scratch->sum, 0, width * sizeof(float));
+  memset(scratch->wsum, 0, width * sizeof(float));
+  for (size_t t = 0; t < taps; t += scratch->max_rows) {
+    size_t rows = taps - t < scratch->max_rows ? taps - t : scratch->max_rows;
+    struct Window win = {src->win.minx, first + t, src->win.maxx,
+                         first + t + rows};
+    if (render_read_window(src, win, scratch->cells) != 0)
+      return 1;
+    resample_vertical(scratch->cells, width, rows, weight + t, scratch->sum,
+                      scratch->wsum);
+  }
+  resample_horizontal(src->xaxis, scratch->sum, scratch->wsum, src->out_width,
+                      out);
+  return 0;
+}
+
+static int render_resampled_rows(struct RenderRows *src, size_t y0, size_t y1,
+                                 uint8_t *rgb) {
+  struct RenderScratch scratch;
+  int16_t *out = malloc(src->out_width * sizeof(int16_t));
+  int failed = render_scratch_init(&scratch, src);
+  if (!failed && out == NULL) {
+    perror("render malloc");
+    failed = 1;
+  }
+
+  for (size_t y = y0; y < y1 && !failed; y++) {
+    failed = render_resampled_row(src, &scratch, y, out);
+    if (failed)
+      break;
+    colorize_row(src->palette, out, src->out_width,
+                 rgb + (y - y0) * src->out_width * 3);
+  }
+
+  render_scratch_free(&scratch);
+  free(out);
+  return failed;
+}
+
+// Rows [y0 - 1, y1 + 1) of window win, clamped at the poles, each with one
+// more cell on either side, wrapping around the antimeridian: the 3x3
+// neighborhoods of the cells of rows [y0, y1).
+static int globe_read_padded(struct Globe *globe, struct Window win, size_t y0,
+                             size_t y1, int16_t *padded) {
+  size_t width = win.maxx - win.minx;
+  size_t pw = width + 2;
+  size_t gy0 = win.miny + y0 > 0 ? win.miny + y0 - 1 : 0;
+  size_t gy1 = win.miny + y1 < GLOBE_ROWS ? win.miny + y1 + 1 : GLOBE_ROWS;
+  size_t lx = win.minx > 0 ? win.minx - 1 : 0;
+  size_t rx = win.maxx < GLOBE_COLS ? win.maxx + 1 : GLOBE_COLS;
+  size_t rows = gy1 - gy0;
+  int16_t *cells = malloc(rows * (rx - lx + 2) * sizeof(int16_t));
+  if (cells == NULL) {
+    perror("render malloc");
+    return 1;
+  }
+  int16_t *left = cells + rows * (rx - lx);
+  int16_t *right = left + rows;
+  struct Window inner = {lx, gy0, rx, gy1};
+  struct Window west = {GLOBE_COLS - 1, gy0, GLOBE_COLS, gy1};
+  struct Window east = {0, gy0, 1, gy1};
+  int failed = globe_read_window(globe, inner, cells) != 0 ||
+               (win.minx == 0 && globe_read_window(globe, west, left)) ||
+               (win.maxx == GLOBE_COLS &&
+                globe_read_window(globe, east, right));
+
+  for (size_t k = 0; k < y1 - y0 + 2 && !failed; k++) {
+    size_t gy = win.miny + y0 + k;
+    gy = gy > gy0 ? gy - 1 : gy0;
+    gy = gy < gy1 ? gy : gy1 - 1;
+    int16_t *row = padded + k * pw;
+    memcpy(row + (win.minx > 0 ? 0 : 1), cells + (gy - gy0) * (rx - lx),
+           (rx - lx) * sizeof(int16_t));
+    if (win.minx == 0)
+      row[0] = left[gy - gy0];
+    if (win.maxx == GLOBE_COLS)
+      row[pw - 1] = right[gy - gy0];
+  }
+  free(cells);
+  return failed;
+}
+
+// Shaded rows: each row is shaded from the rows around it, full resolution
+// or resampled. Resampled images repeat their edge pixels past the border.
+static int render_shaded_rows(struct RenderRows *src, size_t y0, size_t y1,
+                              uint8_t *rgb) {
+  const struct Hillshade *hs = src->shade;
+  size_t width = src->xaxis ? src->out_width : src->win.maxx - src->win.minx;
+  size_t pw = width + 2;
+  size_t rows = y1 - y0 + 2;
+  int16_t *padded = malloc(rows * pw * sizeof(int16_t));
+  uint8_t *shade = malloc(width);
+  struct RenderScratch scratch;
+  int failed = padded == NULL || shade == NULL;
+  if (failed)
+    perror("render malloc");
+
+  if (!failed && src->xaxis == NULL) {
+    failed = globe_read_padded(src->globe, src->win, y0, y1, padded);
+  } else if (!failed) {
+    failed = render_scratch_init(&scratch, src);
+    for (size_t k = 0; k < rows && !failed; k++) {
+      size_t y = y0 + k > 0 ? y0 + k - 1 : 0;
+      y = y < src->out_height ? y : src->out_height - 1;
+      int16_t *row = padded + k * pw;
+      failed = render_resampled_row(src, &scratch, y, row + 1);
+      row[0] = row[1];
+      row[pw - 1] = row[pw - 2];
+    }
+    render_scratch_free(&scratch);
+  }
+
+  for (size_t y = y0; y < y1 && !failed; y++) {
+    const int16_t *mid = padded + (y - y0 + 1) * pw;
+    hillshade_row(hs, y, mid - pw, mid, mid + pw, width, shade);
+    hillshade_colorize(hs, src->palette, mid + 1, shade, width,
+                       rgb + (y - y0) * width * 3);
+  }
+
+  free(padded);
+  free(shade);
+  return failed;
+}
+
+static int render_rows(void *arg, size_t y0, size_t y1, uint8_t *rgb) {
+  struct RenderRows *src = arg;
+  if (src->shade != NULL)
+    return render_shaded_rows(src, y0, y1, rgb);
+  if (src->xaxis != NULL)
+    return render_resampled_rows(src, y0, y1, rgb);
+  struct Window win = {src->win.minx, src->win.miny + y0, src->win.maxx,
+                       src->win.miny + y1};
+  size_t n = (win.maxx - win.minx) * (y1 - y0);
+  int16_t *cells = malloc(n * sizeof(int16_t));
+  if (cells == NULL) {
+    perror("render malloc");
+    return 1;
+  }
+  if (render_read_window(src, win, cells) != 0) {
+    free(cells);
+    return 1;
+  }
+  colorize_row(src->palette, cells, n, rgb);
+  free(cells);
+  return 0;
+}
+
+// Render the bbox to a png. If out_width or out_height is set, the image is
+// resampled to that size, the other side following the bbox aspect ratio.
+// It is then drawn from the mean plane of the coarsest overview level that
+// is at least that large, so its cost follows the output size rather than
+// the bbox.
+static int render(char *in_file, char *out_file, float minlon, float minlat,
+                  float maxlon, float maxlat, size_t out_width,
+                  size_t out_height, enum Resampling resample,
+                  struct Hillshade *shade, int level, size_t num_threads) {
+  struct Window win;
+  if (bbox_to_window(minlon, minlat, maxlon, maxlat, &win) != 0) {
+    printf("Invalid bbox.");
+    return 1;
+  }
+  size_t bbox_width = win.maxx - win.minx;
+  size_t bbox_height = win.maxy - win.miny;
+  int resampled = out_width > 0 || out_height > 0;
+  if (out_width == 0 && resampled)
+    out_width = (size_t)fmax(1, round((double)out_height * bbox_width /
+                                      bbox_height));
+  if (out_height == 0 && resampled)
+    out_height = (size_t)fmax(1, round((double)out_width * bbox_height /
+                                       bbox_width));
+
+  // Open globe. Only the cells inside the bbox are read, a strip at a time
+  // as the png encoder asks for them.
+  struct Globe globe;
+  if (globe_open(&globe, in_file, MADV_RANDOM) != 0)
+    return 1;
+  struct RenderRows src = {&globe, -1,   0, GLOBE_COLS, win, NULL,
+                           NULL,   NULL, 0, 0,          NULL};
+
+  // Pick an overview level.
+  struct Overview ov = {-1, {{0}, 0, 0, 0, 0, {{0, 0, 0}}}};
+  int scale_shift = 0;
+  if (resampled) {
+    char path[PATH_MAX];
+    overview_path(in_file, path, sizeof(path));
+    if (overview_open(&ov, path, in_file) != 0)
+      fprintf(stderr, "%s: no overviews, rendering at full resolution.\n",
+              path);
+    for (int k = ov.fd != -1 ? (int)ov.header.num_levels : 0; k > 0; k--) {
+      struct Window lwin = overview_window(win, k);
+      if (lwin.maxx - lwin.minx >= out_width &&
+          lwin.maxy - lwin.miny >= out_height) {
+        const struct OverviewLevel *ol = &ov.header.levels[k - 1];
+        src.globe = NULL;
+        src.fd = ov.fd;
+        src.offset = overview_plane_offset(ol, OVERVIEW_MEAN);
+        src.cols = ol->cols;
+        src.win = lwin;
+        scale_shift = k;
+        break;
+      }
+    }
+  }
+  size_t width = src.win.maxx - src.win.minx;
+  size_t height = src.win.maxy - src.win.miny;
+
+  // Map output pixels to the bbox in the chosen level's cells.
+  struct ResampleAxis xaxis = {NULL, NULL, NULL, 0};
+  struct ResampleAxis yaxis = {NULL, NULL, NULL, 0};
+  int failed = 0;
+  if (resampled) {
+    double scale = (double)((size_t)1 << scale_shift);
+    failed = resample_axis_init(&xaxis, resample,
+                                win.minx / scale - src.win.minx,
+                                bbox_width / scale / out_width, width,
+                                out_width) != 0 ||
+             resample_axis_init(&yaxis, resample,
+                                win.miny / scale - src.win.miny,
+                                bbox_height / scale / out_height, height,
+                                out_height) != 0;
+    src.xaxis = &xaxis;
+    src.yaxis = &yaxis;
+    src.out_width = out_width;
+    src.out_height = out_height;
+    width = out_width;
+    height = out_height;
+  }
+
+  // Shade with the size of an output pixel, on the ground.
+  if (shade != NULL) {
+    shade->north = 90 - win.miny * CELL_DEG;
+    shade->cell_x = bbox_width * CELL_DEG / width;
+    shade->cell_y = bbox_height * CELL_DEG / height;
+    src.shade = shade;
+  }
+
+  uint32_t *palette = palette_init(TERRAIN);
+  failed = failed || palette == NULL;
+  src.palette = palette;
+
+  // Write the image to a PNG file.
+  if (!failed) {
+    failed = png_write(out_file, render_rows, &src, width, height, level,
+                       num_threads);
+    if (failed)
+      fprintf(stderr, "Failed to write image to file.\n");
+  }
+
+  free(palette);
+  resample_axis_free(&xaxis);
+  resample_axis_free(&yaxis);
+  overview_close(&ov);
+  globe_close(&globe);
+
+  return failed;
+}
+
+// Odd polynomial for atan on [0, 1], from Abramowitz and Stegun 4.4.49,
+// accurate to 2e-8 radians.
+static const float ATAN_POLY[8] = {-0.3333314528f, 0.1999355085f,
+                                   -0.1420889944f, 0.1065626393f,
+                                   -0.0752896400f, 0.0429096138f,
+                                   -0.0161657367f, 0.0028662257f};
+
+// atan2 in degrees, evaluated the same way by the scalar and vector kernels
+// so they agree to the bit.
+static float atan2_deg(float y, float x) {
+  float ax = fabsf(x);
+  float ay = fabsf(y);
+  float hi = ax > ay ? ax : ay;
+  float lo = ax > ay ? ay : ax;
+  float a = hi > 0 ? lo / hi : 0;
+  float s = a * a;
+  float r = ATAN_POLY[7];
+  for (int k = 6; k >= 0; k--)
+    r = r * s + ATAN_POLY[k];
+  r = (r * s + 1) * a;
+  if (ay > ax)
+    r = (float)(M_PI / 2) - r;
+  if (x < 0)
+    r = (float)M_PI - r;
+  if (y < 0)
+    r = -r;
+  return r * (float)(180 / M_PI);
+}
+
+// Slope in degrees, or aspect in degrees clockwise from north of the
+// direction the slope faces, ASPECT_FLAT where there is none. NO_DATA
+// without data.
+static float surface_cell(enum Surface surface, const int16_t *up,
+                          const int16_t *mid, const int16_t *down, float kx,
+                          float ky) {
+  float p, q;
+  if (mid[1] == NO_DATA)
+    return NO_DATA;
+  horn_gradient(up, mid, down, kx, ky, &p, &q);
+  if (surface == SURFACE_SLOPE)
+    return atan2_deg(sqrtf(p * p + q * q), 1);
+  if (p == 0 && q == 0)
+    return ASPECT_FLAT;
+  float aspect = atan2_deg(-p, -q);
+  return aspect < 0 ? aspect + 360 : aspect;
+}
+
+static void surface_row_scalar(enum Surface surface, const int16_t *up,
+                               const int16_t *mid, const int16_t *down,
+                               size_t n, float kx, float ky, float *out) {
+  for (size_t x = 0; x < n; x++)
+    out[x] = surface_cell(surface, up + x, mid + x, down + x, kx, ky);
+}
+
+#ifdef HAVE_X86
+static __attribute__((target("avx2"))) __m256
+atan2_deg_avx2(__m256 y, __m256 x) {
+  const __m256 sign = _mm256_set1_ps(-0.0f);
+  const __m256 zero = _mm256_setzero_ps();
+  __m256 ax = _mm256_andnot_ps(sign, x);
+  __m256 ay = _mm256_andnot_ps(sign, y);
+  __m256 hi = _mm256_max_ps(ax, ay);
+  __m256 lo = _mm256_min_ps(ax, ay);
+  __m256 a = _mm256_blendv_ps(zero, _mm256_div_ps(lo, hi),
+                              _mm256_cmp_ps(hi, zero, _CMP_GT_OQ));
+  __m256 s = _mm256_mul_ps(a, a);
+  __m256 r = _mm256_set1_ps(ATAN_POLY[7]);
+  for (int k = 6; k >= 0; k--)
+    r = _mm256_add_ps(_mm256_mul_ps(r, s), _mm256_set1_ps(ATAN_POLY[k]));
+  r = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(r, s), _mm256_set1_ps(1)), a);
+  r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps((float)(M_PI / 2)), r),
+                       _mm256_cmp_ps(ay, ax, _CMP_GT_OQ));
+  r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps((float)M_PI), r),
+                       _mm256_cmp_ps(x, zero, _CMP_LT_OQ));
+  r = _mm256_blendv_ps(r, _mm256_xor_ps(r, sign),
+                       _mm256_cmp_ps(y, zero, _CMP_LT_OQ));
+  return _mm256_mul_ps(r, _mm256_set1_ps((float)(180 / M_PI)));
+}
+
+// surface_cell for 8 cells at a time, matching it exactly.
+static __attribute__((target("avx2"))) void
+surface_row_avx2(enum Surface surface, const int16_t *up, const int16_t *mid,
+                 const int16_t *down, size_t n, float kx, float ky,
+                 float *out) {
+  const __m256 vkx = _mm256_set1_ps(kx);
+  const __m256 vky = _mm256_set1_ps(ky);
+  const __m256 sign = _mm256_set1_ps(-0.0f);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256i nodata = _mm256_set1_epi32(NO_DATA);
+  size_t x = 0;
+  for (; x + 8 <= n; x += 8) {
+    __m256 p, q, v;
+    horn_gradient_avx2(up + x, mid + x, down + x, vkx, vky, &p, &q);
+    if (surface == SURFACE_SLOPE) {
+      __m256 r = _mm256_sqrt_ps(
+          _mm256_add_ps(_mm256_mul_ps(p, p), _mm256_mul_ps(q, q)));
+      v = atan2_deg_avx2(r, _mm256_set1_ps(1));
+    } else {
+      v = atan2_deg_avx2(_mm256_xor_ps(p, sign), _mm256_xor_ps(q, sign));
+      v = _mm256_blendv_ps(v, _mm256_add_ps(v, _mm256_set1_ps(360)),
+                           _mm256_cmp_ps(v, zero, _CMP_LT_OQ));
+      __m256 flat = _mm256_and_ps(_mm256_cmp_ps(p, zero, _CMP_EQ_OQ),
+                                  _mm256_cmp_ps(q, zero, _CMP_EQ_OQ));
+      v = _mm256_blendv_ps(v, _mm256_set1_ps(ASPECT_FLAT), flat);
+    }
+    __m256i center = _mm256_cvtepi16_epi32(
+        _mm_loadu_si128((const __m128i *)(mid + x + 1)));
+    __m256 missing = _mm256_castsi256_ps(_mm256_cmpeq_epi32(center, nodata));
+    v = _mm256_blendv_ps(v, _mm256_set1_ps(NO_DATA), missing);
+    _mm256_storeu_ps(out + x, v);
+  }
+  surface_row_scalar(surface, up + x, mid + x, down + x, n - x, kx, ky,
+                     out + x);
+}
+#endif
+
+// Slope or aspect of n cells from their neighbor rows, see hillshade_row.
+static void surface_row(enum Surface surface, const int16_t *up,
+                        const int16_t *mid, const int16_t *down, size_t n,
+                        float kx, float ky, float *out) {
+#ifdef HAVE_X86
+  if (__builtin_cpu_supports("avx2")) {
+    surface_row_avx2(surface, up, mid, down, n, kx, ky, out);
+    return;
+  }
+#endif
+  surface_row_scalar(surface, up, mid, down, n, kx, ky, out);
+}
+
+// Quantize a slope to half degrees, 0 to 180, or an aspect to 1.5 degree
+// steps from north, 0 to 239 and 254 for flat. 255 without data.
+static uint8_t surface_quantize(enum Surface surface, float value) {
+  if (value == NO_DATA)
+    return 255;
+  if (surface == SURFACE_SLOPE)
+    return (uint8_t)(value * 2 + 0.5f);
+  if (value == ASPECT_FLAT)
+    return 254;
+  return (uint8_t)((int)(value / 1.5f + 0.5f) % 240);
+}
+
+// Shared state for slope and aspect workers, which claim strips of
+// SURFACE_STRIP_ROWS rows of the window and write each at its place in the
+// output.
+struct SurfaceJob {
+  struct Globe *globe;
+  struct Window win;
+  enum Surface surface;
+  enum RasterType type;
+  double z_factor;
+  int fd;
+  pthread_mutex_t lock;
+  size_t next_strip;
+  size_t num_strips;
+  int failed;
+};
+
+static void *surface_worker(void *arg) {
+  struct SurfaceJob *job = arg;
+  size_t width = job->win.maxx - job->win.minx;
+  size_t height = job->win.maxy - job->win.miny;
+  size_t pw = width + 2;
+  size_t sample = job->type == RASTER_FLOAT32 ? sizeof(float) : 1;
+  int16_t *padded = malloc((SURFACE_STRIP_ROWS + 2) * pw * sizeof(int16_t));
+  float *values = malloc(width * sizeof(float));
+  uint8_t *out = malloc(SURFACE_STRIP_ROWS * width * sample);
+  int failed = padded == NULL || values == NULL || out == NULL;
+  if (failed)
+    perror("surface malloc");
+
+  while (!failed) {
+    pthread_mutex_lock(&job->lock);
+    size_t strip = job->next_strip++;
+    int done = strip >= job->num_strips || job->failed;
+    pthread_mutex_unlock(&job->lock);
+    if (done)
+      break;
+
+    size_t y0 = strip * SURFACE_STRIP_ROWS;
+    size_t y1 = y0 + SURFACE_STRIP_ROWS < height ? y0 + SURFACE_STRIP_ROWS
+                                                 : height;
+    failed = globe_read_padded(job->globe, job->win, y0, y1, padded);
+    for (size_t y = y0; y < y1 && !failed; y++) {
+      const int16_t *mid = padded + (y - y0 + 1) * pw;
+      uint8_t *row = out + (y - y0) * width * sample;
+      float kx, ky;
+      horn_scales(90 - job->win.miny * CELL_DEG, CELL_DEG, CELL_DEG,
+                  job->z_factor, y, &kx, &ky);
+      surface_row(job->surface, mid - pw, mid, mid + pw, width, kx, ky,
+                  job->type == RASTER_FLOAT32 ? (float *)row : values);
+      if (job->type == RASTER_UINT8) {
+        for (size_t x = 0; x < width; x++)
+          row[x] = surface_quantize(job->surface, values[x]);
+      }
+    }
+    failed = failed ||
+             pwrite_full(job->fd, out, (y1 - y0) * width * sample,
+                         (off_t)(y0 * width * sample)) != 0;
+  }
+
+  if (failed) {
+    pthread_mutex_lock(&job->lock);
+    job->failed = 1;
+    pthread_mutex_unlock(&job->lock);
+  }
+  free(padded);
+  free(values);
+  free(out);
+  return NULL;
+}
+
+// Write the slope or aspect of every cell of win to out_file, a row-major
+// little-endian raster of float32 or uint8 samples. Strips are computed in
+// parallel and written as they finish, so memory stays a few strips per
+// thread for any window.
+static int surface(char *in_file, char *out_file, enum Surface surface,
+                   struct Window win, enum RasterType type, double z_factor,
+                   size_t num_threads) {
+  struct Globe globe;
+  if (globe_open(&globe, in_file, MADV_SEQUENTIAL) != 0)
+    return 1;
+  int fd = open(out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    perror("open");
+    globe_close(&globe);
+    return 1;
+  }
+
+  size_t height = win.maxy - win.miny;
+  struct SurfaceJob job = {&globe,
+                           win,
+                           surface,
+                           type,
+                           z_factor,
+                           fd,
+                           PTHREAD_MUTEX_INITIALIZER,
+                           0,
+                           (height + SURFACE_STRIP_ROWS - 1) /
+                               SURFACE_STRIP_ROWS,
+                           0};
+  run_workers(surface_worker, &job, num_threads);
+  int failed = job.failed;
+  if (close(fd) == -1) {
+    perror("close");
+    failed = 1;
+  }
+  if (failed)
+    unlink(out_file);
+  globe_close(&globe);
+  return failed;
+}
+
+// Contours. Marching squares runs over the squares between the centers of
+// four neighboring cells, and each level a square spans crosses it as one
+// segment, or two at a saddle, between points on its edges. Segments are
+// directed with higher ground on their left, so the segment that ends on an
+// edge joins the one that starts there.
+
+// Segments of each square case as (from, to) edges, 0 top, 1 right,
+// 2 bottom, 3 left, -1 for none. Case bits are the corners at or above the
+// level: 8 top left, 4 top right, 2 bottom right, 1 bottom left. Saddles 5
+// and 10 are listed with the center below the level, CONTOUR_SADDLES holds
+// them with the center above.
+static const int8_t CONTOUR_CASES[16][4] = {
+    {-1, -1, -1, -1}, {2, 3, -1, -1}, {1, 2, -1, -1}, {1, 3, -1, -1},
+    {0, 1, -1, -1},   {0, 1, 2, 3},   {0, 2, -1, -1}, {0, 3, -1, -1},
+    {3, 0, -1, -1},   {2, 0, -1, -1}, {3, 0, 1, 2},   {1, 0, -1, -1},
+    {3, 1, -1, -1},   {2, 1, -1, -1}, {3, 2, -1, -1}, {-1, -1, -1, -1}};
+static const int8_t CONTOUR_SADDLES[2][4] = {{0, 3, 2, 1}, {1, 0, 3, 2}};
+
+// Corners each edge runs between, left or top first.
+static const int8_t CONTOUR_EDGE_CORNERS[4][2] = {
+    {0, 1}, {1, 2}, {3, 2}, {0, 3}};
+
+// A run of points, lon and lat pairs at offset in a point buffer, from the
+// edge named by key from to the edge named by key to. A key is the edge,
+// counted two per cell in row-major order, horizontal first, above a 16 bit
+// level.
+struct ContourLine {
+  uint64_t from;
+  uint64_t to;
+  size_t offset;
+  size_t num_points;
+};
+
+static uint64_t contour_key(size_t x, size_t y, int vertical, int level) {
+  return (uint64_t)((y * GLOBE_COLS + x) * 2 + vertical) << 16 |
+         (uint16_t)level;
+}
+
+// Point where level crosses edge of the square at (x, y), x1 being the column
+// right of x. The crossing is interpolated between the edge's corners, always
+// in the same direction, so the two squares sharing an edge agree on it.
+static uint64_t contour_edge(int edge, size_t x, size_t x1, size_t y,
+                             const int16_t *corners, int level, float *point) {
+  int a = corners[CONTOUR_EDGE_CORNERS[edge][0]];
+  int b = corners[CONTOUR_EDGE_CORNERS[edge][1]];
+  double t = (double)(level - a) / (b - a);
+  int vertical = edge & 1;
+  size_t ex = edge == 1 ? x1 : x;
+  size_t ey = edge == 2 ? y + 1 : y;
+  double lon = -180 + (ex + 0.5 + (vertical ? 0 : t)) * CELL_DEG;
+  point[0] = (float)(lon > 180 ? lon - 360 : lon);
+  point[1] = (float)(90 - (ey + 0.5 + (vertical ? t : 0)) * CELL_DEG);
+  return contour_key(ex, ey, vertical, level);
+}
+
+// Shared state for contour workers, which claim bands of CONTOUR_BAND_ROWS
+// rows of squares. steps maps each elevation, as a uint16_t, to the number of
+// intervals below it, rounded down. lines and points hold the lines that go
+// on past the last band written, next_lines, next_points and out are scratch
+// for joining them with the next band's.
+struct ContourJob {
+  struct Globe *globe;
+  struct Window win;
+  int interval;
+  const int16_t *steps;
+  int min_level;
+  int max_level;
+  int binary;
+  int fd;
+  pthread_mutex_t lock;
+  pthread_cond_t turn;
+  size_t next_band;
+  size_t next_write;
+  size_t num_bands;
+  int started;
+  struct Buf lines;
+  struct Buf points;
+  struct Buf next_lines;
+  struct Buf next_points;
+  struct Buf out;
+  int failed;
+};
+
+// Segments of the square between cells i and i1 of rows top and bottom,
+// steps holding each cell's elevation divided by the interval, rounded down.
+// Squares with a cell without data have none.
+static void contour_square(const struct ContourJob *job, const int16_t *top,
+                           const int16_t *bottom, const int16_t *steps_top,
+                           const int16_t *steps_bottom, size_t i, size_t i1,
+                           size_t y, struct Buf *lines, struct Buf *points) {
+  const int16_t v[4] = {top[i], top[i1], bottom[i1], bottom[i]};
+  if (v[0] == NO_DATA || v[1] == NO_DATA || v[2] == NO_DATA ||
+      v[3] == NO_DATA)
+    return;
+  int lo = steps_top[i] < steps_top[i1] ? steps_top[i] : steps_top[i1];
+  int hi = steps_top[i] > steps_top[i1] ? steps_top[i] : steps_top[i1];
+  lo = steps_bottom[i] < lo ? steps_bottom[i] : lo;
+  lo = steps_bottom[i1] < lo ? steps_bottom[i1] : lo;
+  hi = steps_bottom[i] > hi ? steps_bottom[i] : hi;
+  hi = steps_bottom[i1] > hi ? steps_bottom[i1] : hi;
+
+  size_t x = job->win.minx + i;
+  size_t x1 = job->win.minx + i1;
+  for (int m = lo + 1; m <= hi; m++) {
+    int level = m * job->interval;
+    if (level < job->min_level || level > job->max_level)
+      continue;
+    int c = (v[0] >= level) << 3 | (v[1] >= level) << 2 |
+            (v[2] >= level) << 1 | (v[3] >= level);
+    const int8_t *pairs = CONTOUR_CASES[c];
+    if ((c == 5 || c == 10) && v[0] + v[1] + v[2] + v[3] >= 4 * level)
+      pairs = CONTOUR_SADDLES[c == 10];
+    for (int p = 0; p < 4 && pairs[p] >= 0; p += 2) {
+      float point[4];
+      struct ContourLine seg;
+      seg.from = contour_edge(pairs[p], x, x1, y, v, level, point);
+      seg.to = contour_edge(pairs[p + 1], x, x1, y, v, level, point + 2);
+      seg.offset = points->len / (2 * sizeof(float));
+      seg.num_points = 2;
+      buf_put(lines, &seg, sizeof(seg));
+      buf_put(points, point, sizeof(point));
+    }
+  }
+}
+
+// Map each of n cells to its step.
+static void contour_steps(const struct ContourJob *job, const int16_t *cells,
+                          size_t n, int16_t *steps) {
+  for (size_t c = 0; c < n; c++)
+    steps[c] = job->steps[(uint16_t)cells[c]];
+}
+
+// Write the columns from i0 to i1 of the squares between rows top and bottom
+// of steps, width wide, whose corners are not all in the same interval to
+// sel, returns how many there are. Only those can have segments.
+static size_t contour_spans_scalar(const int16_t *top, const int16_t *bottom,
+                                   size_t width, size_t i0, size_t i1,
+                                   uint16_t *sel) {
+  size_t n = 0;
+  for (size_t i = i0; i < i1; i++) {
+    size_t next = i + 1 < width ? i + 1 : 0;
+    if (top[i] != top[next] || top[i] != bottom[i] || top[i] != bottom[next])
+      sel[n++] = (uint16_t)i;
+  }
+  return n;
+}
+
+#ifdef HAVE_X86
+static __attribute__((target("avx2"))) size_t
+contour_spans_avx2(const int16_t *top, const int16_t *bottom, size_t width,
+                   size_t i0, size_t i1, uint16_t *sel) {
+  size_t n = 0;
+  size_t i = i0;
+  for (; i + 16 <= i1 && i + 16 < width; i += 16) {
+    __m256i t = _mm256_loadu_si256((const __m256i *)(top + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(bottom + i));
+    __m256i same = _mm256_and_si256(
+        _mm256_cmpeq_epi16(
+            t, _mm256_loadu_si256((const __m256i *)(top + i + 1))),
+        _mm256_cmpeq_epi16(
+            t, _mm256_loadu_si256((const __m256i *)(bottom + i + 1))));
+    same = _mm256_and_si256(same, _mm256_cmpeq_epi16(t, b));
+    uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(same) & 0x55555555;
+    while (mask) {
+      sel[n++] = (uint16_t)(i + __builtin_ctz(mask) / 2);
+      mask &= mask - 1;
+    }
+  }
+  return n + contour_spans_scalar(top, bottom, width, i, i1, sel + n);
+}
+#endif
+
+static size_t contour_spans(const int16_t *top, const int16_t *bottom,
+                            size_t width, size_t i0, size_t i1, uint16_t *sel) {
+#ifdef HAVE_X86
+  if (__builtin_cpu_supports("avx2"))
+    return contour_spans_avx2(top, bottom, width, i0, i1, sel);
+#endif
+  return contour_spans_scalar(top, bottom, width, i0, i1, sel);
+}
+
+// Segments of the squares in rows y0 to y1 and columns i0 to i1 of the
+// window, cells and steps holding rows y0 to y1 inclusive. Squares wrap
+// around the antimeridian when the window spans it.
+static void contour_tile(const struct ContourJob *job, const int16_t *cells,
+                         const int16_t *steps, size_t y0, size_t y1, size_t i0,
+                         size_t i1, struct Buf *lines, struct Buf *points) {
+  size_t width = job->win.maxx - job->win.minx;
+  uint16_t sel[CONTOUR_TILE_COLS];
+  for (size_t y = y0; y < y1; y++) {
+    const int16_t *top = cells + (y - y0) * width;
+    const int16_t *steps_top = steps + (y - y0) * width;
+    size_t n = contour_spans(steps_top, steps_top + width, width, i0, i1, sel);
+    for (size_t k = 0; k < n; k++) {
+      size_t next = (size_t)sel[k] + 1 < width ? (size_t)sel[k] + 1 : 0;
+      contour_square(job, top, top + width, steps_top, steps_top + width,
+                     sel[k], next, y, lines, points);
+    }
+  }
+}
+
+// Writes a line to out as a GeoJSON feature, preceded by a comma, or as a
+// binary record: int16 level, uint32 number of points, then float32 lon and
+// lat of each point.
+static void contour_format(struct Buf *out, int binary, int16_t level,
+                           const float *points, size_t n) {
+  if (binary) {
+    uint32_t num_points = (uint32_t)n;
+    buf_put(out, &level, sizeof(level));
+    buf_put(out, &num_points, sizeof(num_points));
+    buf_put(out, points, n * 2 * sizeof(float));
+    return;
+  }
+  char text[64];
+  int len = snprintf(text, sizeof(text),
+                     ",\n{\"type\":\"Feature\",\"properties\":{\"elev\":%d},",
+                     level);
+  buf_put(out, text, (size_t)len);
+  static const char geometry[] =
+      "\"geometry\":{\"type\":\"LineString\",\"coordinates\":[";
+  buf_put(out, geometry, sizeof(geometry) - 1);
+  for (size_t p = 0; p < n; p++) {
+    // 5 decimals, about a meter.
+    len = 0;
+    text[len++] = p > 0 ? ',' : '[';
+    if (p > 0)
+      text[len++] = '[';
+    for (int c = 0; c < 2; c++) {
+      long fixed = lround(points[2 * p + c] * 1e5);
+      char digits[16];
+      int d = 0;
+      if (fixed < 0) {
+        text[len++] = '-';
+        fixed = -fixed;
+      }
+      for (int k = 0; k <= 5 || fixed > 0; k++) {
+        digits[d++] = '0' + fixed % 10;
+        fixed /= 10;
+        if (k == 4)
+          digits[d++] = '.';
+      }
+      while (d > 0)
+        text[len++] = digits[--d];
+      text[len++] = c == 0 ? ',' : ']';
+    }
+    buf_put(out, text, (size_t)len);
+  }
+  buf_put(out, "]}}", 3);
+}
+
+// Where joined lines go. Lines with an end on top_row or bottom_row, or on
+// left_col or right_col, go on past the tile or band and are set aside in
+// lines and points, the rest are formatted into out.
+struct ContourSink {
+  size_t top_row;
+  size_t bottom_row;
+  size_t left_col;
+  size_t right_col;
+  int binary;
+  struct Buf *out;
+  struct Buf *lines;
+  struct Buf *points;
+};
+
+static int contour_open(const struct ContourSink *sink, uint64_t key) {
+  uint64_t edge = key >> 16;
+  size_t y = (edge >> 1) / GLOBE_COLS;
+  size_t x = (edge >> 1) % GLOBE_COLS;
+  if (edge & 1)
+    return x == sink->left_col || x == sink->right_col;
+  return y == sink->top_row || y == sink->bottom_row;
+}
+
+static void contour_emit(struct ContourSink *sink, uint64_t from, uint64_t to,
+                         const float *points, size_t n) {
+  if (contour_open(sink, from) || contour_open(sink, to)) {
+    struct ContourLine line = {from, to,
+                               sink->points->len / (2 * sizeof(float)), n};
+    buf_put(sink->lines, &line, sizeof(line));
+    buf_put(sink->points, points, n * 2 * sizeof(float));
+    return;
+  }
+  if (n > 1)
+    contour_format(sink->out, sink->binary, (int16_t)(from & 0xffff), points,
+                   n);
+}
+
+static size_t contour_hash(uint64_t key, int bits) {
+  return (size_t)((key * 0x9E3779B97F4A7C15ull) >> (64 - bits));
+}
+
+// Joins lines end to start into as few lines as possible and emits them,
+// open lines first from the piece nothing ends on, then rings. Repeated
+// points, where pieces meet or where a level passes through a cell center,
+// are kept once, and a ring ends on its first point.
+static int contour_join(const struct ContourLine *lines, size_t n,
+                        const float *points, struct ContourSink *sink) {
+  if (n == 0)
+    return 0;
+  int bits = 1;
+  while (((size_t)1 << bits) < 2 * n)
+    bits++;
+  size_t mask = ((size_t)1 << bits) - 1;
+  size_t *table = malloc((mask + 1) * sizeof(size_t));
+  size_t *next = malloc(n * sizeof(size_t));
+  uint8_t *joined = calloc(n, 2);
+  if (table == NULL || next == NULL || joined == NULL) {
+    perror("contour malloc");
+    free(table);
+    free(next);
+    free(joined);
+    return 1;
+  }
+  uint8_t *has_prev = joined + n;
+
+  for (size_t h = 0; h <= mask; h++)
+    table[h] = SIZE_MAX;
+  for (size_t i = 0; i < n; i++) {
+    size_t h = contour_hash(lines[i].from, bits);
+    while (table[h] != SIZE_MAX)
+      h = (h + 1) & mask;
+    table[h] = i;
+  }
+  for (size_t i = 0; i < n; i++) {
+    next[i] = SIZE_MAX;
+    for (size_t h = contour_hash(lines[i].to, bits); table[h] != SIZE_MAX;
+         h = (h + 1) & mask) {
+      if (lines[table[h]].from == lines[i].to) {
+        next[i] = table[h];
+        has_prev[next[i]] = 1;
+        break;
+      }
+    }
+  }
+
+  struct Buf chain = {NULL, 0, 0, 0};
+  for (int rings = 0; rings < 2; rings++) {
+    for (size_t i = 0; i < n; i++) {
+      if (joined[i] || (has_prev[i] && !rings))
+        continue;
+      size_t j = i;
+      size_t last = i;
+      chain.len = 0;
+      do {
+        const float *p = points + 2 * lines[j].offset;
+        size_t m = lines[j].num_points;
+        joined[j] = 1;
+        if (chain.len == 0) {
+          buf_put(&chain, p, 2 * sizeof(float));
+          p += 2;
+          m--;
+        }
+        const float *end = (float *)(chain.data + chain.len) - 2;
+        while (m > 0 && !chain.failed && end[0] == p[0] && end[1] == p[1]) {
+          p += 2;
+          m--;
+        }
+        buf_put(&chain, p, m * 2 * sizeof(float));
+        last = j;
+        j = next[j];
+      } while (j != SIZE_MAX && !joined[j]);
+      contour_emit(sink, lines[i].from, lines[last].to, (float *)chain.data,
+                   chain.len / (2 * sizeof(float)));
+    }
+  }
+
+  int failed = chain.failed;
+  free(chain.data);
+  free(table);
+  free(next);
+  free(joined);
+  return failed;
+}
+
+// Writes out, dropping the comma before the first GeoJSON feature.
+static int contour_write(struct ContourJob *job, const struct Buf *out) {
+  if (out->len == 0)
+    return 0;
+  size_t skip = !job->binary && !job->started ? 2 : 0;
+  job->started = 1;
+  return write_full(job->fd, out->data + skip, out->len - skip);
+}
+
+// Joins the lines band left open at its edges with those open from the bands
+// above, writes the ones that are done and keeps those that end on row
+// bottom, the last row of band, for the next band.
+static int contour_merge(struct ContourJob *job, struct Buf *lines,
+                         const struct Buf *points, size_t bottom) {
+  struct ContourLine *open = (struct ContourLine *)lines->data;
+  size_t num_open = lines->len / sizeof(struct ContourLine);
+  for (size_t l = 0; l < num_open; l++)
+    open[l].offset += job->points.len / (2 * sizeof(float));
+  buf_put(&job->lines, lines->data, lines->len);
+  buf_put(&job->points, points->data, points->len);
+
+  job->next_lines.len = job->next_points.len = job->out.len = 0;
+  struct ContourSink sink = {SIZE_MAX,
+                             bottom,
+                             SIZE_MAX,
+                             SIZE_MAX,
+                             job->binary,
+                             &job->out,
+                             &job->next_lines,
+                             &job->next_points};
+  if (job->lines.failed || job->points.failed ||
+      contour_join((struct ContourLine *)job->lines.data,
+                   job->lines.len / sizeof(struct ContourLine),
+                   (float *)job->points.data, &sink) != 0 ||
+      job->out.failed || job->next_lines.failed || job->next_points.failed)
+    return 1;
+  struct Buf swap = job->lines;
+  job->lines = job->next_lines;
+  job->next_lines = swap;
+  swap = job->points;
+  job->points = job->next_points;
+  job->next_points = swap;
+  return contour_write(job, &job->out);
+}
+
+// Buffers of a worker's band. lines and points hold the segments of a tile,
+// pieces and piece_points the lines that cross its edges, and open_lines and
+// open_points the lines that cross the band's.
+struct ContourBand {
+  struct Buf lines;
+  struct Buf points;
+  struct Buf pieces;
+  struct Buf piece_points;
+  struct Buf out;
+  struct Buf open_lines;
+  struct Buf open_points;
+};
+
+// Lines of square rows y0 to y1, formatted into out unless they go on past
+// top_row or bottom_row. Each tile of CONTOUR_TILE_COLS columns is joined on
+// its own, so the join's table stays in cache, then the pieces crossing tile
+// edges are joined.
+static int contour_band(const struct ContourJob *job, const int16_t *cells,
+                        const int16_t *steps, size_t y0, size_t y1,
+                        size_t top_row, size_t bottom_row,
+                        struct ContourBand *band) {
+  size_t width = job->win.maxx - job->win.minx;
+  size_t n = width == GLOBE_COLS ? width : width - 1;
+  band->pieces.len = band->piece_points.len = band->out.len = 0;
+  band->open_lines.len = band->open_points.len = 0;
+  for (size_t i0 = 0; i0 < n; i0 += CONTOUR_TILE_COLS) {
+    size_t i1 = i0 + CONTOUR_TILE_COLS < n ? i0 + CONTOUR_TILE_COLS : n;
+    band->lines.len = band->points.len = 0;
+    contour_tile(job, cells, steps, y0, y1, i0, i1, &band->lines,
+                 &band->points);
+    struct ContourSink sink = {top_row,
+                               bottom_row,
+                               job->win.minx + i0,
+                               i1 < width ? job->win.minx + i1 : 0,
+                               job->binary,
+                               &band->out,
+                               &band->pieces,
+                               &band->piece_points};
+    if (band->lines.failed || band->points.failed ||
+        contour_join((struct ContourLine *)band->lines.data,
+                     band->lines.len / sizeof(struct ContourLine),
+                     (float *)band->points.data, &sink) != 0)
+      return 1;
+  }
+
+  struct ContourSink sink = {top_row,
+                             bottom_row,
+                             SIZE_MAX,
+                             SIZE_MAX,
+                             job->binary,
+                             &band->out,
+                             &band->open_lines,
+                             &band->open_points};
+  return band->pieces.failed || band->piece_points.failed ||
+         contour_join((struct ContourLine *)band->pieces.data,
+                      band->pieces.len / sizeof(struct ContourLine),
+                      (float *)band->piece_points.data, &sink) != 0 ||
+         band->out.failed || band->open_lines.failed ||
+         band->open_points.failed;
+}
+
+// Workers join the segments of their band into lines, then wait for their
+// turn to write the lines that are done and merge the rest with the lines
+// left open above, so output is in band order for any number of threads.
+static void *contour_worker(void *arg) {
+  struct ContourJob *job = arg;
+  struct Window win = job->win;
+  size_t width = win.maxx - win.minx;
+  size_t last_row = win.maxy - 1;
+  int16_t *cells = malloc((CONTOUR_BAND_ROWS + 1) * width * sizeof(int16_t));
+  int16_t *steps = malloc((CONTOUR_BAND_ROWS + 1) * width * sizeof(int16_t));
+  struct ContourBand bufs;
+  memset(&bufs, 0, sizeof(bufs));
+  int failed = cells == NULL || steps == NULL;
+  if (failed)
+    perror("contour malloc");
+
+  while (!failed) {
+    pthread_mutex_lock(&job->lock);
+    size_t band = job->next_band++;
+    int done = band >= job->num_bands || job->failed;
+    pthread_mutex_unlock(&job->lock);
+    if (done)
+      break;
+
+    // Squares of the band, joined into lines.
+    size_t y0 = win.miny + band * CONTOUR_BAND_ROWS;
+    size_t y1 = y0 + CONTOUR_BAND_ROWS < last_row ? y0 + CONTOUR_BAND_ROWS
+                                                  : last_row;
+    struct Window rows = {win.minx, y0, win.maxx, y1 + 1};
+    failed = globe_read_window(job->globe, rows, cells) != 0;
+    if (!failed) {
+      contour_steps(job, cells, (y1 - y0 + 1) * width, steps);
+      failed = contour_band(job, cells, steps, y0, y1,
+                            band > 0 ? y0 : SIZE_MAX,
+                            y1 < last_row ? y1 : SIZE_MAX, &bufs);
+    }
+
+    // Wait for the previous band to be written, then write this one.
+    pthread_mutex_lock(&job->lock);
+    if (failed) {
+      job->failed = 1;
+      pthread_cond_broadcast(&job->turn);
+    }
+    while (job->next_write != band && !job->failed)
+      pthread_cond_wait(&job->turn, &job->lock);
+    done = job->failed;
+    pthread_mutex_unlock(&job->lock);
+    if (done)
+      break;
+    failed = contour_write(job, &bufs.out) != 0 ||
+             contour_merge(job, &bufs.open_lines, &bufs.open_points,
+                           y1 < last_row ? y1 : SIZE_MAX) != 0;
+    pthread_mutex_lock(&job->lock);
+    job->next_write++;
+    job->failed |= failed;
+    pthread_cond_broadcast(&job->turn);
+    pthread_mutex_unlock(&job->lock);
+  }
+
+  if (failed) {
+    pthread_mutex_lock(&job->lock);
+    job->failed = 1;
+    pthread_cond_broadcast(&job->turn);
+    pthread_mutex_unlock(&job->lock);
+  }
+  free(cells);
+  free(steps);
+  free(bufs.lines.data);
+  free(bufs.points.data);
+  free(bufs.pieces.data);
+  free(bufs.piece_points.data);
+  free(bufs.out.data);
+  free(bufs.open_lines.data);
+  free(bufs.open_points.data);
+  return NULL;
+}
+
+// Write contour lines every interval meters, within the elevation range of
+// filter, of the cells of its window to out_file: GeoJSON LineStrings with
+// an elev property, or with binary, CONTOUR_MAGIC followed by the records of
+// contour_format. Lines cut by band edges are joined as bands are written, so
+// only those crossing the last one written stay in memory.
+static int contour(char *in_file, char *out_file, const struct Filter *filter,
+                   int interval, int binary, size_t num_threads) {
+  struct Globe globe;
+  if (globe_open(&globe, in_file, MADV_SEQUENTIAL) != 0)
+    return 1;
+  int fd = open(out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    perror("open");
+    globe_close(&globe);
+    return 1;
+  }
+
+  int16_t steps[UINT16_MAX + 1];
+  for (long v = INT16_MIN; v <= INT16_MAX; v++)
+    steps[(uint16_t)v] = (int16_t)floor((double)v / interval);
+
+  struct Window win = filter->win;
+  size_t square_rows = win.maxy - win.miny - 1;
+  struct ContourJob job = {&globe,
+                           win,
+                           interval,
+                           steps,
+                           filter->min_elev,
+                           filter->max_elev,
+                           binary,
+                           fd,
+                           PTHREAD_MUTEX_INITIALIZER,
+                           PTHREAD_COND_INITIALIZER,
+                           0,
+                           0,
+                           (square_rows + CONTOUR_BAND_ROWS - 1) /
+                               CONTOUR_BAND_ROWS,
+                           0,
+                           {NULL, 0, 0, 0},
+                           {NULL, 0, 0, 0},
+                           {NULL, 0, 0, 0},
+                           {NULL, 0, 0, 0},
+                           {NULL, 0, 0, 0},
+                           0};
+  static const char header[] =
+      "{\"type\":\"FeatureCollection\",\"features\":[\n";
+  static const char footer[] = "\n]}\n";
+  job.failed = binary ? write_full(fd, CONTOUR_MAGIC, strlen(CONTOUR_MAGIC))
+                      : write_full(fd, header, sizeof(header) - 1);
+  if (!job.failed)
+    run_workers(contour_worker, &job, num_threads);
+
+  if (!job.failed && !binary)
+    job.failed = write_full(fd, footer, sizeof(footer) - 1);
+
+  if (close(fd) == -1) {
+    perror("close");
+    job.failed = 1;
+  }
+  if (job.failed)
+    unlink(out_file);
+  free(job.lines.data);
+  free(job.points.data);
+  free(job.next_lines.data);
+  free(job.next_points.data);
+  free(job.out.data);
+  globe_close(&globe);
+  return job.failed;
+}
+
+// Source of tile rows: a tile of cells colorized through the palette.
+struct TileRows {
+  const int16_t *cells;
+  const uint32_t *palette;
+};
+
+static int tile_rows(void *arg, size_t y0, size_t y1, uint8_t *rgb) {
+  struct TileRows *src = arg;
+  colorize_row(src->palette, src->cells + y0 * TILE_SIZE,
+               (y1 - y0) * TILE_SIZE, rgb);
+  return 0;
+}
+
+// Shared state for tile workers. Each task is the subtree under one tile of
+// task_zoom; its own tile is kept in task_tiles to build the levels above.
+struct TilesJob {
+  const struct Globe *globe;
+  const uint32_t *palette;
+  char *out_dir;
+  int max_zoom;
+  int task_zoom;
+  int level;
+  int16_t *task_tiles;
+  pthread_mutex_t lock;
+  size_t next_task;
+  size_t num_tasks;
+  int failed;
+};
+
+// Sample tile (z, x, y) of the Web Mercator pyramid from the full resolution
+// globe, taking the cell under each pixel center. buf holds GLOBE_COLS cells
+// of scratch for reading globe rows.
+static int tile_sample(const struct Globe *globe, int z, size_t x, size_t y,
+                       int16_t *buf, int16_t *out) {
+  double n = (double)TILE_SIZE * (double)((size_t)1 << z);
+  size_t cols[TILE_SIZE];
+  for (size_t px = 0; px < TILE_SIZE; px++) {
+    double lon = (x * TILE_SIZE + px + 0.5) / n * 360.0 - 180.0;
+    size_t col = (size_t)((lon + 180.0) / CELL_DEG);
+    cols[px] = col < GLOBE_COLS ? col : GLOBE_COLS - 1;
+  }
+  for (size_t py = 0; py < TILE_SIZE; py++) {
+    double merc = M_PI * (1.0 - 2.0 * (y * TILE_SIZE + py + 0.5) / n);
+    double lat = atan(sinh(merc)) * 180.0 / M_PI;
+    size_t row = (size_t)((90.0 - lat) / CELL_DEG);
+    const int16_t *src =
+        globe_row(globe, row < GLOBE_ROWS ? row : GLOBE_ROWS - 1, cols[0],
+                  cols[TILE_SIZE - 1] + 1, buf);
+    if (src == NULL)
+      return 1;
+    for (size_t px = 0; px < TILE_SIZE; px++)
+      out[py * TILE_SIZE + px] = src[cols[px]];
+  }
+  return 0;
+}
+
+// Downsample a child tile 2x into quadrant (qx, qy) of its parent. Each
+// parent pixel is the mean of the 2x2 child pixels that have data.
+static void tile_downsample(const int16_t *child, int16_t *parent, size_t qx,
+                            size_t qy) {
+  size_t half = TILE_SIZE / 2;
+  for (size_t y = 0; y < half; y++) {
+    const int16_t *r0 = child + 2 * y * TILE_SIZE;
+    const int16_t *r1 = r0 + TILE_SIZE;
+    int16_t *dst = parent + (qy * half + y) * TILE_SIZE + qx * half;
+    for (size_t x = 0; x < half; x++) {
+      int16_t v[4] = {r0[2 * x], r0[2 * x + 1], r1[2 * x], r1[2 * x + 1]};
+      int sum = 0;
+      int count = 0;
+      for (int i = 0; i < 4; i++) {
+        if (v[i] != NO_DATA) {
+          sum += v[i];
+          count++;
+        }
+      }
+      dst[x] = count ? (int16_t)(sum / count) : NO_DATA;
+    }
+  }
+}
+
+static int tile_write(struct TilesJob *job, int z, size_t x, size_t y,
+                      const int16_t *cells) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%d/%zu/%zu.png", job->out_dir, z, x, y);
+  struct TileRows src = {cells, job->palette};
+  return png_write(path, tile_rows, &src, TILE_SIZE, TILE_SIZE, job->level, 1);
+}
+
+// Build and write tile (z, x, y) and every tile under it, depth first. The
+// deepest level is sampled from the globe and each level above is
+// downsampled from the four tiles below it, so only one tile per level is
+// held at a time. row is tile_sample's scratch.
+static int tile_build(struct TilesJob *job, int z, size_t x, size_t y,
+                      int16_t *row, int16_t *out) {
+  if (z == job->max_zoom) {
+    if (tile_sample(job->globe, z, x, y, row, out) != 0)
+      return 1;
+  } else {
+    int16_t *child = malloc(TILE_CELLS * sizeof(int16_t));
+    if (child == NULL) {
+      perror("tile malloc");
+      return 1;
+    }
+    for (size_t i = 0; i < 4; i++) {
+      if (tile_build(job, z + 1, 2 * x + (i & 1), 2 * y + (i >> 1), row,
+                     child) != 0) {
+        free(child);
+        return 1;
+      }
+      tile_downsample(child, out, i & 1, i >> 1);
+    }
+    free(child);
+  }
+  return tile_write(job, z, x, y, out);
+}
+
+static void *tiles_worker(void *arg) {
+  struct TilesJob *job = arg;
+  size_t tiles_per_row = (size_t)1 << job->task_zoom;
+  int16_t *row = malloc(GLOBE_COLS * sizeof(int16_t));
+  int failed = row == NULL;
+  if (failed)
+    perror("tile malloc");
+  while (!failed) {
+    pthread_mutex_lock(&job->lock);
+    size_t task = job->next_task++;
+    int done = task >= job->num_tasks || job->failed;
+    pthread_mutex_unlock(&job->lock);
+    if (done)
+      break;
+
+    failed = tile_build(job, job->task_zoom, task % tiles_per_row,
+                        task / tiles_per_row, row,
+                        job->task_tiles + task * TILE_CELLS) != 0;
+  }
+  if (failed) {
+    pthread_mutex_lock(&job->lock);
+    job->failed = 1;
+    pthread_mutex_unlock(&job->lock);
+  }
+  free(row);
+  return NULL;
+}
+
+static int make_dir(const char *path) {
+  if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+    perror(path);
+    return 1;
+  }
+  return 0;
+}
+
+// Create out_dir/z/x for every level up front, so workers only write files.
+static int tiles_make_dirs(char *out_dir, int max_zoom) {
+  char path[PATH_MAX];
+  if (make_dir(out_dir) != 0)
+    return 1;
+  for (int z = 0; z <= max_zoom; z++) {
+    snprintf(path, sizeof(path), "%s/%d", out_dir, z);
+    if (make_dir(path) != 0)
+      return 1;
+    for (size_t x = 0; x < (size_t)1 << z; x++) {
+      snprintf(path, sizeof(path), "%s/%d/%zu", out_dir, z, x);
+      if (make_dir(path) != 0)
+        return 1;
+    }
+  }
+  return 0;
+}
+
+// Write the z0 to max_zoom XYZ pyramid of 256x256 Web Mercator png tiles to
+// out_dir/z/x/y.png. Subtrees under the tiles of a middle level are built in
+// parallel; the few tiles above them are then downsampled from their output.
+static int tiles(char *in_file, char *out_dir, int max_zoom, int level,
+                 size_t num_threads) {
+  if (tiles_make_dirs(out_dir, max_zoom) != 0)
+    return 1;
+
+  struct Globe globe;
+  if (globe_open(&globe, in_file, MADV_NORMAL) != 0)
+    return 1;
+  uint32_t *palette = palette_init(TERRAIN);
+  if (palette == NULL) {
+    globe_close(&globe);
+    return 1;
+  }
+
+  int task_zoom = max_zoom < TILES_TASK_ZOOM ? max_zoom : TILES_TASK_ZOOM;
+  size_t num_tasks = (size_t)1 << (2 * task_zoom);
+  struct TilesJob job = {&globe,
+                         palette,
+                         out_dir,
+                         max_zoom,
+                         task_zoom,
+                         level,
+                         malloc(num_tasks * TILE_CELLS * sizeof(int16_t)),
+                         PTHREAD_MUTEX_INITIALIZER,
+                         0,
+                         num_tasks,
+                         0};
+  int failed = job.task_tiles == NULL;
+  if (failed)
+    perror("tiles malloc");
+  else
+    run_workers(tiles_worker, &job, num_threads);
+  failed = failed || job.failed;
+  globe_close(&globe);
+
+  // Levels above the tasks, each from the one below.
+  int16_t *below = job.task_tiles;
+  for (int z = task_zoom - 1; z >= 0 && !failed; z--) {
+    size_t side = (size_t)1 << z;
+    int16_t *above = malloc(side * side * TILE_CELLS * sizeof(int16_t));
+    if (above == NULL) {
+      perror("tiles malloc");
+      failed = 1;
+      break;
+    }
+    for (size_t y = 0; y < side && !failed; y++) {
+      for (size_t x = 0; x < side && !failed; x++) {
+        int16_t *tile = above + (y * side + x) * TILE_CELLS;
+        for (size_t i = 0; i < 4; i++) {
+          size_t cx = 2 * x + (i & 1);
+          size_t cy = 2 * y + (i >> 1);
+          tile_downsample(below + (cy * 2 * side + cx) * TILE_CELLS, tile,
+                          i & 1, i >> 1);
+        }
+        failed = tile_write(&job, z, x, y, tile);
+      }
+    }
+    free(below);
+    below = above;
+  }
+  free(below);
+  free(palette);
+
+  return failed;
+}
+
+// Build the table and parquet filter from flags. Unset bbox edges default to
+// the edge of the globe. Without elevation bounds, sea level cells are
+// skipped as before; with them, the range decides.
+static int make_filter(float minlon, float minlat, float maxlon, float maxlat,
+                       long min_elev, long max_elev, struct Filter *filter) {
+  if (bbox_to_window(minlon > INT16_MIN ? minlon : -180,
+                     minlat > INT16_MIN ? minlat : -90,
+                     maxlon > INT16_MIN ? maxlon : 180,
+                     maxlat > INT16_MIN ? maxlat : 90, &filter->win) != 0) {
+    printf("Invalid bbox.\n");
+    return 1;
+  }
+  filter->skip_zero = min_elev == LONG_MIN && max_elev == LONG_MAX;
+  filter->min_elev = min_elev < INT16_MIN ? INT16_MIN : (int16_t)min_elev;
+  filter->max_elev = max_elev > INT16_MAX ? INT16_MAX : (int16_t)max_elev;
+  if (min_elev > INT16_MAX || max_elev < INT16_MIN ||
+      filter->min_elev > filter->max_elev) {
+    printf("Invalid elevation range.\n");
+    return 1;
+  }
+  return 0;
+}
+
+// Cell (x, y) of the globe, checking its block first.
+static int globe_cell(const struct Globe *globe, size_t x, size_t y,
+                      int16_t *value) {
+  size_t bx = x / GLOBE_BLOCK;
+  size_t by = y / GLOBE_BLOCK;
+  if (globe->layout == LAYOUT_ROWS) {
+    if (globe_verify(globe, by * GLOBE_BLOCKS_ACROSS + bx) != 0)
+      return 1;
+    *value = ((const int16_t *)((const uint8_t *)globe->data +
+                                globe->offset))[y * GLOBE_COLS + x];
+    return 0;
+  }
+  const int16_t *block = globe_block_get(globe, bx, by);
+  if (block == NULL)
+    return 1;
+  *value = block[(y % GLOBE_BLOCK) * GLOBE_BLOCK + x % GLOBE_BLOCK];
+  globe_block_put(globe, bx, by);
+  return 0;
+}
+
+// Whether lon/lat is a point on the globe. NaNs are not.
+static int lonlat_valid(double lon, double lat) {
+  return lon >= -180 && lon <= 180 && lat >= -90 && lat <= 90;
+}
+
+// Fractional column and row of lon/lat, the mapping bbox_to_window rounds.
+static void lonlat_to_grid(double lon, double lat, double *gx, double *gy) {
+  *gx = (lon + 180) / 360 * GLOBE_COLS;
+  *gy = (90 - lat) / 180 * GLOBE_ROWS;
+}
+
+// Cell containing grid position (gx, gy). The antimeridian and the poles
+// belong to the last column and row.
+static void grid_to_cell(double gx, double gy, size_t *x, size_t *y) {
+  *x = gx < GLOBE_COLS ? (size_t)gx : GLOBE_COLS - 1;
+  *y = gy < GLOBE_ROWS ? (size_t)gy : GLOBE_ROWS - 1;
+}
 
-  // Alocate array for chunk. Reused and freed at the end.
-  int16_t *chunk_data = malloc(MAX_CHUNK_SIZE * sizeof(int16_t));
-  if (chunk_data == NULL) {
-    perror("chunk malloc");
+int globe_query(const struct Globe *globe, double lon, double lat,
+                enum Resampling resample, double *elev) {
+  *elev = NO_DATA;
+  if (!lonlat_valid(lon, lat))
+    return 0;
+  double gx, gy;
+  size_t x, y;
+  int16_t value;
+  lonlat_to_grid(lon, lat, &gx, &gy);
+  grid_to_cell(gx, gy, &x, &y);
+  if (globe_cell(globe, x, y, &value) != 0)
     return 1;
+  if (resample != RESAMPLE_BILINEAR || value == NO_DATA) {
+    *elev = value;
+    return 0;
   }
-  // Alocate array for global array.
-  int16_t *globe_data = malloc(GLOBE_CELLS * sizeof(int16_t));
-  if (globe_data == NULL) {
-    perror("globe malloc");
-    free(chunk_data);
-    return 1;
+
+  // Interpolate between the centers of the 2x2 cells around the point. The
+  // globe wraps around in longitude and is clamped at the poles. Neighbors
+  // without data are left out and the weights of the others renormalized.
+  double fx = gx - 0.5;
+  double fy = gy - 0.5;
+  double x0 = floor(fx);
+  double y0 = floor(fy);
+  double tx = fx - x0;
+  double ty = fy - y0;
+  double sum = 0;
+  double wsum = 0;
+  for (int k = 0; k < 4; k++) {
+    double w = (k & 1 ? tx : 1 - tx) * (k & 2 ? ty : 1 - ty);
+    double cx = x0 + (k & 1);
+    double cy = y0 + (k >> 1);
+    x = cx < 0 ? GLOBE_COLS - 1 : (size_t)cx % GLOBE_COLS;
+    y = cy < 0 ? 0 : cy >= GLOBE_ROWS ? GLOBE_ROWS - 1 : (size_t)cy;
+    if (w == 0)
+      continue;
+    if (globe_cell(globe, x, y, &value) != 0)
+      return 1;
+    if (value == NO_DATA)
+      continue;
+    sum += w * value;
+    wsum += w;
   }
+  if (wsum > 0)
+    *elev = sum / wsum;
+  return 0;
+}
 
-  for (size_t c = 0; c < NUM_CHUNKS; c++) {
-    struct Chunk chunk = chunks[c];
+// A point of a batch query and the position of its cell in the file, so
+// sorting by it visits the file front to back and each block once.
+struct QueryKey {
+  uint64_t cell;
+  size_t point;
+};
+
+static int query_key_cmp(const void *a, const void *b) {
+  const struct QueryKey *ka = a;
+  const struct QueryKey *kb = b;
+  return (ka->cell > kb->cell) - (ka->cell < kb->cell);
+}
 
-    FILE *fp;
-    size_t num_vals;
+// Shared state for batch query workers, which claim QUERY_BATCH keys at a
+// time.
+struct QueryJob {
+  const struct Globe *globe;
+  const double *lonlat;
+  const struct QueryKey *keys;
+  size_t num_points;
+  enum Resampling resample;
+  double *elev;
+  pthread_mutex_t lock;
+  size_t next_key;
+  int failed;
+};
 
-    // Open chunk file.
-    if ((fp = fopen(chunk.name, "rb")) == NULL) {
-      perror("fopen");
-      free(chunk_data);
-      free(globe_data);
-      return 1;
-    }
+static void *query_worker(void *arg) {
+  struct QueryJob *job = arg;
+  for (;;) {
+    pthread_mutex_lock(&job->lock);
+    size_t k0 = job->next_key;
+    int done = k0 >= job->num_points || job->failed;
+    job->next_key += QUERY_BATCH;
+    pthread_mutex_unlock(&job->lock);
+    if (done)
+      break;
 
-    // Find end of chunk.
-    fseek(fp, 0, SEEK_END);
-    if (ferror(fp)) {
-      perror("fseek");
-      fclose(fp);
-      free(chunk_data);
-      free(globe_data);
-      return 1;
+    size_t k1 = k0 + QUERY_BATCH < job->num_points ? k0 + QUERY_BATCH
+                                                   : job->num_points;
+    for (size_t k = k0; k < k1; k++) {
+      size_t p = job->keys[k].point;
+      if (globe_query(job->globe, job->lonlat[2 * p], job->lonlat[2 * p + 1],
+                      job->resample, &job->elev[p]) != 0) {
+        pthread_mutex_lock(&job->lock);
+        job->failed = 1;
+        pthread_mutex_unlock(&job->lock);
+        break;
+      }
     }
-    errno = 0;
-    size_t file_length = ftell(fp);
-    if (errno != 0) {
-      perror("ftell");
-      fclose(fp);
-      free(chunk_data);
-      free(globe_data);
+  }
+  return NULL;
+}
+
+int globe_query_batch(const struct Globe *globe, const double *lonlat,
+                      size_t n, enum Resampling resample, double *elev,
+                      size_t num_threads) {
+  struct QueryKey *keys = malloc(n * sizeof(*keys));
+  if (keys == NULL && n > 0) {
+    perror("query malloc");
+    return 1;
+  }
+  for (size_t p = 0; p < n; p++) {
+    double gx, gy;
+    size_t x = 0, y = 0;
+    lonlat_to_grid(lonlat[2 * p], lonlat[2 * p + 1], &gx, &gy);
+    if (gx >= 0 && gy >= 0)
+      grid_to_cell(gx, gy, &x, &y);
+    size_t block = y / GLOBE_BLOCK * GLOBE_BLOCKS_ACROSS + x / GLOBE_BLOCK;
+    keys[p].cell = y * GLOBE_COLS + x;
+    if (globe->layout != LAYOUT_ROWS)
+      keys[p].cell = (uint64_t)block * GLOBE_BLOCK * GLOBE_BLOCK +
+                     y % GLOBE_BLOCK * GLOBE_BLOCK + x % GLOBE_BLOCK;
+    keys[p].point = p;
+  }
+  qsort(keys, n, sizeof(*keys), query_key_cmp);
+
+  struct QueryJob job = {globe, lonlat, keys, n, resample, elev,
+                         PTHREAD_MUTEX_INITIALIZER, 0, 0};
+  if (num_threads > (n + QUERY_BATCH - 1) / QUERY_BATCH)
+    num_threads = (n + QUERY_BATCH - 1) / QUERY_BATCH;
+  if (n > 0)
+    run_workers(query_worker, &job, num_threads);
+  free(keys);
+  return job.failed;
+}
+
+// Read all of fd into buf.
+static int read_all(int fd, struct Buf *buf) {
+  uint8_t chunk[65536];
+  for (;;) {
+    ssize_t n = read(fd, chunk, sizeof(chunk));
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1) {
+      perror("read");
       return 1;
     }
+    if (n == 0)
+      return buf->failed;
+    buf_put(buf, chunk, (size_t)n);
+  }
+}
 
-    // Go back to start of chunk.
-    errno = 0;
-    rewind(fp);
-    if (errno != 0) {
-      perror("rewind");
-      fclose(fp);
-      free(chunk_data);
-      free(globe_data);
-      return 1;
+// Parse "lon,lat" lines, or lon and lat separated by spaces, into lon, lat
+// pairs.
+static int query_parse_csv(char *text, struct Buf *lonlat) {
+  size_t line = 0;
+  for (char *p = text; *p != '\0';) {
+    char *end = strchr(p, '\n');
+    if (end != NULL)
+      *end = '\0';
+    line++;
+    char *q = p + strspn(p, " \t\r");
+    if (*q != '\0') {
+      double point[2];
+      point[0] = strtod(q, &q);
+      q += strspn(q, ", \t");
+      char *lat = q;
+      point[1] = strtod(lat, &q);
+      if (q == lat || q[strspn(q, " \t\r")] != '\0') {
+        fprintf(stderr, "line %zu: expected lon,lat.\n", line);
+        return 1;
+      }
+      buf_put(lonlat, point, sizeof(point));
     }
+    if (end == NULL)
+      break;
+    p = end + 1;
+  }
+  return lonlat->failed;
+}
+
+// Look up the elevation of one point, or of every point of points_file
+// (stdin if NULL), and write them in input order. CSV input is lon,lat lines
+// and output lon,lat,elev lines; binary input is pairs of float64 lon, lat
+// and output one float32 elevation per point.
+static int query(char *in_file, char *points_file, char *out_file, double lon,
+                 double lat, enum Resampling resample, int binary,
+                 size_t num_threads) {
+  struct Globe globe;
+  if (globe_open(&globe, in_file, MADV_RANDOM) != 0)
+    return 1;
 
-    // Read file into array.
-    num_vals =
-        fread(chunk_data, sizeof(int16_t), file_length / sizeof(int16_t), fp);
-    if (ferror(fp)) {
-      perror("fread");
-      fclose(fp);
-      free(chunk_data);
-      free(globe_data);
+  // Gather the points.
+  struct Buf input = {0};
+  struct Buf lonlat = {0};
+  int failed = 0;
+  if (!isnan(lon) && !isnan(lat)) {
+    double point[2] = {lon, lat};
+    buf_put(&lonlat, point, sizeof(point));
+  } else {
+    int fd = points_file ? open(points_file, O_RDONLY) : STDIN_FILENO;
+    if (fd == -1) {
+      perror("open");
+      globe_close(&globe);
       return 1;
     }
+    failed = read_all(fd, &input);
+    if (fd != STDIN_FILENO)
+      close(fd);
+    if (!failed && binary) {
+      if (input.len % (2 * sizeof(double)) != 0) {
+        fprintf(stderr, "points: expected pairs of float64.\n");
+        failed = 1;
+      }
+      lonlat = input;
+      input = (struct Buf){0};
+    } else if (!failed) {
+      buf_byte(&input, '\0');
+      failed = input.failed || query_parse_csv((char *)input.data, &lonlat);
+    }
+    free(input.data);
+  }
+  failed |= lonlat.failed;
+  size_t n = lonlat.len / (2 * sizeof(double));
+  const double *points = (const double *)lonlat.data;
 
-    // Done, close file.
-    fclose(fp);
+  // Look them up.
+  double *elev = malloc((n > 0 ? n : 1) * sizeof(double));
+  if (!failed && elev == NULL) {
+    perror("query malloc");
+    failed = 1;
+  }
+  if (!failed)
+    failed = globe_query_batch(&globe, points, n, resample, elev, num_threads);
+  globe_close(&globe);
 
-    // Calculate chunk stats.
-    int16_t min = INT16_MAX;
-    int16_t max = INT16_MIN;
-    float sum = 0.0;
-    for (size_t i = 0; i < num_vals; i++) {
-      if (chunk_data[i] != NO_DATA) {
-        sum += chunk_data[i];
-        if (chunk_data[i] < min)
-          min = chunk_data[i];
-        if (chunk_data[i] > max)
-          max = chunk_data[i];
-      }
-    }
-    float mean = sum / num_vals;
-
-    // Copy chunk data row by row into global array.
-    size_t row_offset = chunk.row_offset;
-    // Log debug info.
-    printf("name: %s, count: %zu, mean: %.2f, min: %hd, max: %hd\n", chunk.name,
-           num_vals, mean, min, max);
-    for (size_t row = 0; row < chunk.num_rows; row++) {
-      // Calculate the starting position in globe_data for this row.
-      size_t globe_row_start =
-          (row_offset + row) * GLOBE_COLS + chunk.col_offset;
-      // Calculate the starting position in chunk_data for this row.
-      size_t chunk_row_start = row * chunk.num_cols;
-      // Copy the row from chunk_data to globe_data.
-      memcpy(globe_data + globe_row_start, chunk_data + chunk_row_start,
-             chunk.num_cols * sizeof(int16_t));
+  // Write them out.
+  int fd = STDOUT_FILENO;
+  if (!failed && out_file &&
+      (fd = open(out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+    perror("open");
+    failed = 1;
+  }
+  struct Buf out = {0};
+  for (size_t p = 0; p < n && !failed; p++) {
+    if (binary) {
+      float value = (float)elev[p];
+      buf_put(&out, &value, sizeof(value));
+    } else {
+      char line[CSV_LINE_MAX + COORD_STR_LEN];
+      int len = snprintf(line, sizeof(line),
+                         resample == RESAMPLE_BILINEAR ? "%.6f,%.6f,%.2f\n"
+                                                       : "%.6f,%.6f,%.0f\n",
+                         points[2 * p], points[2 * p + 1], elev[p]);
+      buf_put(&out, line, (size_t)len);
+    }
+    if (out.len >= CSV_BUF_SIZE || p + 1 == n) {
+      failed = out.failed || write_full(fd, out.data, out.len) != 0;
+      out.len = 0;
     }
   }
-
-  // Write globe bin data.
-  FILE *globe_bin_file;
-  // char globebin_name[] = "globe.16int_t.bin";
-  if ((globe_bin_file = fopen(out_file, "wb")) == NULL) {
-    perror("fopen");
-    exit(1);
+  if (fd != STDOUT_FILENO && close(fd) == -1) {
+    perror("close");
+    failed = 1;
   }
-  fwrite(globe_data, sizeof(int16_t), GLOBE_CELLS, globe_bin_file);
-  fclose(globe_bin_file);
 
-  // Free data.
-  free(chunk_data);
-  free(globe_data);
+  free(out.data);
+  free(elev);
+  free(lonlat.data);
+  return failed;
+}
 
-  return 0;
+// Rendered tiles kept by the server, least recently used first out once
+// they add up to more than max_bytes. Keys pack z, x and y.
+struct TileEntry {
+  uint64_t key;
+  uint8_t *png;
+  size_t len;
+  struct TileEntry *prev;
+  struct TileEntry *next;
+  struct TileEntry *chain;
+};
+
+struct TileCache {
+  pthread_mutex_t lock;
+  size_t bytes;
+  size_t max_bytes;
+  struct TileEntry *newest;
+  struct TileEntry *oldest;
+  struct TileEntry *buckets[TILE_CACHE_BUCKETS];
+};
+
+static uint64_t tile_key(int z, size_t x, size_t y) {
+  return (uint64_t)z << 48 | (uint64_t)x << 24 | (uint64_t)y;
 }
 
-int table(char *in_file, char *out_file) {
-  int16_t *globe_data = malloc(GLOBE_CELLS * sizeof(int16_t));
-  if (globe_data == NULL) {
-    perror("globe malloc");
-    return 1;
-  }
+static struct TileEntry **tile_cache_find(struct TileCache *cache,
+                                          uint64_t key) {
+  struct TileEntry **e = &cache->buckets[key * 0x9e3779b97f4a7c15 >> 52];
+  while (*e != NULL && (*e)->key != key)
+    e = &(*e)->chain;
+  return e;
+}
 
-  FILE *fp;
-  // Open file.
-  if ((fp = fopen(in_file, "rb")) == NULL) {
-    perror("fopen");
-    free(globe_data);
-    return 1;
+static void tile_cache_unlink(struct TileCache *cache, struct TileEntry *e) {
+  *(e->prev ? &e->prev->next : &cache->newest) = e->next;
+  *(e->next ? &e->next->prev : &cache->oldest) = e->prev;
+}
+
+static void tile_cache_push(struct TileCache *cache, struct TileEntry *e) {
+  e->prev = NULL;
+  e->next = cache->newest;
+  *(cache->newest ? &cache->newest->prev : &cache->oldest) = e;
+  cache->newest = e;
+}
+
+// Append the cached PNG of key to out. Returns 0 if it wasn't cached.
+static int tile_cache_get(struct TileCache *cache, uint64_t key,
+                          struct Buf *out) {
+  pthread_mutex_lock(&cache->lock);
+  struct TileEntry *e = *tile_cache_find(cache, key);
+  if (e != NULL) {
+    tile_cache_unlink(cache, e);
+    tile_cache_push(cache, e);
+    buf_put(out, e->png, e->len);
   }
+  pthread_mutex_unlock(&cache->lock);
+  return e != NULL;
+}
 
-  // Read file into array.
-  fread(globe_data, sizeof(int16_t), GLOBE_CELLS, fp);
-  if (ferror(fp)) {
-    perror("fread");
-    fclose(fp);
-    free(globe_data);
-    return 1;
+// Cache a copy of png under key, evicting the oldest tiles to make room.
+static void tile_cache_put(struct TileCache *cache, uint64_t key,
+                           const uint8_t *png, size_t len) {
+  if (len > cache->max_bytes)
+    return;
+  struct TileEntry *e = malloc(sizeof(*e));
+  uint8_t *copy = malloc(len);
+  if (e == NULL || copy == NULL) {
+    free(e);
+    free(copy);
+    return;
   }
+  memcpy(copy, png, len);
+  *e = (struct TileEntry){key, copy, len, NULL, NULL, NULL};
 
-  // Done, close file.
-  fclose(fp);
+  pthread_mutex_lock(&cache->lock);
+  struct TileEntry **slot = tile_cache_find(cache, key);
+  if (*slot != NULL) {
+    // Another worker rendered it first.
+    pthread_mutex_unlock(&cache->lock);
+    free(copy);
+    free(e);
+    return;
+  }
+  *slot = e;
+  tile_cache_push(cache, e);
+  cache->bytes += len;
+  while (cache->bytes > cache->max_bytes) {
+    struct TileEntry *old = cache->oldest;
+    struct TileEntry **p = tile_cache_find(cache, old->key);
+    *p = old->chain;
+    tile_cache_unlink(cache, old);
+    cache->bytes -= old->len;
+    free(old->png);
+    free(old);
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
 
-  // Open csv.
-  FILE *globe_csv_file;
-  // Open file.
-  if ((globe_csv_file = fopen(out_file, "ab")) == NULL) {
-    perror("fopen");
-    free(globe_data);
-    return 1;
+static void tile_cache_free(struct TileCache *cache) {
+  for (struct TileEntry *e = cache->newest, *next; e != NULL; e = next) {
+    next = e->next;
+    free(e->png);
+    free(e);
   }
+}
 
-  // Traverse cells.
-  float lon = -180.0;
-  float lat = 90.0;
-  int16_t elevation = NO_DATA;
-  size_t idx = 0;
-  fprintf(globe_csv_file, "lon,lat,elev\n");
-  for (size_t y = 0; y < GLOBE_ROWS; y++) {
-    for (size_t x = 0; x < GLOBE_COLS; x++) {
-      idx = y * GLOBE_COLS + x;
-      elevation = globe_data[idx];
+// Buffers of one serve worker, reused across requests. tile and row are
+// allocated by the first tile request the worker serves.
+struct ServeScratch {
+  struct Buf body;
+  int16_t *tile;
+  int16_t *row;
+};
+
+// A client connection. The event loop reads into req until it holds a whole
+// request header, then hands the connection to a worker, which answers and
+// hands it back for the next request.
+struct Conn {
+  int fd;
+  size_t len;
+  char req[SERVE_REQUEST_MAX];
+  struct Conn *next;
+};
+
+// Shared state for the server: the globe mapped once, the tile cache, and
+// the queue of connections with a request ready.
+struct Server {
+  const struct Globe *globe;
+  const uint32_t *palette;
+  struct TileCache *tiles;
+  int level;
+  int epoll_fd;
+  int listen_fd;
+  int signal_fd;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  struct Conn *head;
+  struct Conn *tail;
+  int stop;
+};
 
-      if (elevation != NO_DATA && elevation != 0) {
-        fprintf(globe_csv_file, "%f,%f,%d\n", lon, lat, elevation);
+// Value of name in a URL query string, percent-decoded into out. Returns 1
+// if it is there, 0 if it isn't, and -1 if it has a bad escape or doesn't
+// fit.
+static int serve_param(const char *query, const char *name, char *out,
+                       size_t size) {
+  size_t name_len = strlen(name);
+  for (const char *p = query; p != NULL && *p != '\0';) {
+    const char *end = strchr(p, '&');
+    if (strncmp(p, name, name_len) == 0 && p[name_len] == '=') {
+      size_t n = 0;
+      p += name_len + 1;
+      for (; *p != '\0' && *p != '&' && n + 1 < size; p++) {
+        unsigned hex;
+        if (*p == '%') {
+          if (!isxdigit((unsigned char)p[1]) ||
+              !isxdigit((unsigned char)p[2]) ||
+              sscanf(p + 1, "%2x", &hex) != 1)
+            return -1;
+          out[n++] = (char)hex;
+          p += 2;
+        } else {
+          out[n++] = *p == '+' ? ' ' : *p;
+        }
       }
-      lon += 0.008333;
-      idx++;
+      out[n] = '\0';
+      return *p == '\0' || *p == '&' ? 1 : -1;
     }
-    lon = -180.0;
-    lat -= 0.008333;
+    p = end ? end + 1 : NULL;
   }
+  return 0;
+}
 
+// Parse a comma separated list of up to max numbers. Returns how many, or 0
+// if any isn't a finite number.
+static size_t serve_numbers(const char *s, double *out, size_t max) {
+  size_t n = 0;
+  while (n < max) {
+    char *end;
+    out[n] = strtod(s, &end);
+    if (end == s || !isfinite(out[n]))
+      return 0;
+    n++;
+    if (*end == '\0')
+      return n;
+    if (*end != ',')
+      return 0;
+    s = end + 1;
+  }
   return 0;
 }
 
-int render(char *in_file, char *out_file, float minlon, float minlat,
-           float maxlon, float maxlat) {
-  int16_t *globe_data = malloc(GLOBE_CELLS * sizeof(int16_t));
-  if (globe_data == NULL) {
-    perror("globe malloc");
+// Resampling named by the resample parameter, nearest if there is none.
+static int serve_resampling(const char *query, enum Resampling *resample) {
+  char value[16];
+  *resample = RESAMPLE_NEAREST;
+  int found = serve_param(query, "resample", value, sizeof(value));
+  if (found < 0)
     return 1;
+  if (found == 0 || strcmp(value, "nearest") == 0)
+    return 0;
+  if (strcmp(value, "bilinear") == 0) {
+    *resample = RESAMPLE_BILINEAR;
+    return 0;
   }
+  return 1;
+}
 
-  FILE *fp;
-  // Open file.
-  if ((fp = fopen(in_file, "rb")) == NULL) {
-    perror("fopen");
-    free(globe_data);
-    return 1;
+static void serve_json_elev(struct Buf *out, double elev) {
+  char text[32];
+  int len = elev == NO_DATA ? snprintf(text, sizeof(text), "null")
+                            : snprintf(text, sizeof(text), "%.2f", elev);
+  buf_put(out, text, (size_t)len);
+}
+
+// GET /elevation?lon=&lat=[&resample=bilinear]
+static int serve_elevation(struct Server *server, const char *query,
+                           struct Buf *body) {
+  char lon_text[32], lat_text[32];
+  double lon, lat, elev;
+  enum Resampling resample;
+  if (serve_param(query, "lon", lon_text, sizeof(lon_text)) != 1 ||
+      serve_param(query, "lat", lat_text, sizeof(lat_text)) != 1 ||
+      serve_numbers(lon_text, &lon, 1) != 1 ||
+      serve_numbers(lat_text, &lat, 1) != 1 || !lonlat_valid(lon, lat) ||
+      serve_resampling(query, &resample) != 0)
+    return 400;
+  if (globe_query(server->globe, lon, lat, resample, &elev) != 0)
+    return 500;
+
+  char text[96];
+  int len = snprintf(text, sizeof(text), "{\"lon\":%.6f,\"lat\":%.6f,\"elev\":",
+                     lon, lat);
+  buf_put(body, text, (size_t)len);
+  serve_json_elev(body, elev);
+  buf_byte(body, '}');
+  return 200;
+}
+
+// Great circle distance in meters between two points.
+static double haversine_m(double lon0, double lat0, double lon1, double lat1) {
+  double rad = M_PI / 180;
+  double dlat = (lat1 - lat0) * rad;
+  double dlon = (lon1 - lon0) * rad;
+  double a = sin(dlat / 2) * sin(dlat / 2) +
+             cos(lat0 * rad) * cos(lat1 * rad) * sin(dlon / 2) * sin(dlon / 2);
+  return 2 * EARTH_RADIUS_M * asin(sqrt(a < 1 ? a : 1));
+}
+
+// GET /profile?path=lon,lat,lon,lat,...&samples=N[&resample=bilinear]
+// Elevations at samples points spaced evenly along the path, with their
+// great circle distance in meters from its start.
+static int serve_profile(struct Server *server, const char *query,
+                         struct Buf *body) {
+  char path_text[SERVE_REQUEST_MAX];
+  char samples_text[16];
+  double path[2 * SERVE_PATH_MAX];
+  long samples = SERVE_DEFAULT_SAMPLES;
+  enum Resampling resample;
+  if (serve_param(query, "path", path_text, sizeof(path_text)) != 1 ||
+      serve_resampling(query, &resample) != 0)
+    return 400;
+  int found = serve_param(query, "samples", samples_text, sizeof(samples_text));
+  if (found < 0)
+    return 400;
+  if (found)
+    samples = atol(samples_text);
+  size_t n = serve_numbers(path_text, path, 2 * SERVE_PATH_MAX) / 2;
+  if (n < 2 || samples < 2 || samples > SERVE_MAX_SAMPLES)
+    return 400;
+  for (size_t i = 0; i < n; i++)
+    if (!lonlat_valid(path[2 * i], path[2 * i + 1]))
+      return 400;
+
+  // Length along the path, in degrees, up to each vertex.
+  double along[SERVE_PATH_MAX];
+  along[0] = 0;
+  for (size_t i = 1; i < n; i++)
+    along[i] = along[i - 1] + hypot(path[2 * i] - path[2 * i - 2],
+                                    path[2 * i + 1] - path[2 * i - 1]);
+
+  buf_put(body, "{\"points\":[", 11);
+  size_t seg = 0;
+  double meters = 0;
+  double prev_lon = path[0], prev_lat = path[1];
+  for (long s = 0; s < samples; s++) {
+    double d = along[n - 1] * (double)s / (double)(samples - 1);
+    while (seg + 2 < n && along[seg + 1] < d)
+      seg++;
+    double len = along[seg + 1] - along[seg];
+    double t = len > 0 ? (d - along[seg]) / len : 0;
+    if (t > 1)
+      t = 1;
+    double lon = path[2 * seg] + t * (path[2 * seg + 2] - path[2 * seg]);
+    double lat =
+        path[2 * seg + 1] + t * (path[2 * seg + 3] - path[2 * seg + 1]);
+    meters += haversine_m(prev_lon, prev_lat, lon, lat);
+    prev_lon = lon;
+    prev_lat = lat;
+
+    double elev;
+    if (globe_query(server->globe, lon, lat, resample, &elev) != 0)
+      return 500;
+    char text[96];
+    int text_len =
+        snprintf(text, sizeof(text), "%s[%.6f,%.6f,%.1f,", s ? "," : "", lon,
+                 lat, meters);
+    buf_put(body, text, (size_t)text_len);
+    serve_json_elev(body, elev);
+    buf_byte(body, ']');
   }
+  buf_put(body, "]}", 2);
+  return 200;
+}
 
-  // Read file into array.
-  fread(globe_data, sizeof(int16_t), GLOBE_CELLS, fp);
-  if (ferror(fp)) {
-    perror("fread");
-    fclose(fp);
-    free(globe_data);
-    return 1;
+// GET /tiles/z/x/y.png, sampled like the deepest level of `globe tiles`.
+static int serve_tile(struct Server *server, const char *path,
+                      struct ServeScratch *scratch) {
+  struct Buf *body = &scratch->body;
+  int z;
+  size_t x, y;
+  int end = 0;
+  if (sscanf(path, "/tiles/%d/%zu/%zu.png%n", &z, &x, &y, &end) != 3 ||
+      path[end] != '\0' || z < 0 || z > TILES_MAX_ZOOM ||
+      x >= (size_t)1 << z || y >= (size_t)1 << z)
+    return 404;
+  uint64_t key = tile_key(z, x, y);
+  if (tile_cache_get(server->tiles, key, body))
+    return body->failed ? 500 : 200;
+
+  if (scratch->tile == NULL) {
+    scratch->tile = malloc(TILE_CELLS * sizeof(int16_t));
+    scratch->row = malloc(GLOBE_COLS * sizeof(int16_t));
+    if (scratch->tile == NULL || scratch->row == NULL) {
+      perror("tile malloc");
+      free(scratch->tile);
+      free(scratch->row);
+      scratch->tile = scratch->row = NULL;
+      return 500;
+    }
   }
+  struct TileRows src = {scratch->tile, server->palette};
+  if (tile_sample(server->globe, z, x, y, scratch->row, scratch->tile) != 0 ||
+      png_encode(-1, body, tile_rows, &src, TILE_SIZE, TILE_SIZE,
+                 server->level, 1) != 0)
+    return 500;
+  tile_cache_put(server->tiles, key, body->data, body->len);
+  return 200;
+}
 
-  // Done, close file.
-  fclose(fp);
+static const char *serve_reason(int status) {
+  switch (status) {
+  case 200:
+    return "OK";
+  case 400:
+    return "Bad Request";
+  case 404:
+    return "Not Found";
+  case 405:
+    return "Method Not Allowed";
+  default:
+    return "Internal Server Error";
+  }
+}
 
-  // Write .png image.
-  size_t minx = (size_t)round(((minlon + 180) / 360) * GLOBE_COLS);
-  size_t miny = (size_t)round(((180 - (maxlat + 90)) / 180) * GLOBE_ROWS);
-  size_t maxx = (size_t)round(((maxlon + 180) / 360) * GLOBE_COLS);
-  size_t maxy = (size_t)round(((180 - (minlat + 90)) / 180) * GLOBE_ROWS);
-  if (minx >= maxx || miny >= maxy) {
-    printf("Invalid bbox.");
-    free(globe_data);
-    return 1;
+// Send all of buf on a non-blocking socket, waiting for room as needed.
+// flags can add MSG_MORE to hold back a partial packet.
+static int serve_send(int fd, const void *buf, size_t len, int flags) {
+  const uint8_t *p = buf;
+  while (len > 0) {
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL | flags);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      struct pollfd pfd = {fd, POLLOUT, 0};
+      if (poll(&pfd, 1, SERVE_SEND_TIMEOUT_MS) <= 0)
+        return 1;
+      continue;
+    }
+    if (n == -1)
+      return 1;
+    p += n;
+    len -= (size_t)n;
   }
-  size_t width = maxx - minx;
-  size_t height = maxy - miny;
-  int channels = 3; // RGB
+  return 0;
+}
 
-  // Allocate memory for the image data
-  uint8_t *image = malloc(width * height * channels);
-  if (image == NULL) {
-    fprintf(stderr, "Failed to allocate memory for image.\n");
-    free(globe_data);
-    return 1;
+// Answer the request of header_len bytes at the start of conn->req. Returns
+// whether the connection stays open.
+static int serve_request(struct Server *server, struct Conn *conn,
+                         size_t header_len, struct ServeScratch *scratch) {
+  struct Buf *body = &scratch->body;
+  char method[8], target[SERVE_REQUEST_MAX], version[16];
+  int status;
+  const char *type = "application/json";
+  conn->req[header_len - 1] = '\0';
+  int keep_alive = 0;
+  body->len = 0;
+  body->failed = 0;
+  if (sscanf(conn->req, "%7s %8191s HTTP/%15s", method, target, version) !=
+      3) {
+    status = 400;
+  } else {
+    // HTTP/1.1 keeps the connection by default, 1.0 only when asked.
+    keep_alive = strcmp(version, "1.1") == 0;
+    for (const char *line = strchr(conn->req, '\n'); line != NULL;
+         line = strchr(line + 1, '\n')) {
+      if (strncasecmp(line + 1, "Connection:", 11) == 0) {
+        const char *value = line + 12 + strspn(line + 12, " \t");
+        keep_alive = strncasecmp(value, "keep-alive", 10) == 0 ||
+                     (keep_alive && strncasecmp(value, "close", 5) != 0);
+      }
+    }
+
+    char *query = strchr(target, '?');
+    if (query != NULL)
+      *query++ = '\0';
+    if (strcmp(method, "GET") != 0)
+      status = 405;
+    else if (strcmp(target, "/elevation") == 0)
+      status = serve_elevation(server, query, body);
+    else if (strcmp(target, "/profile") == 0)
+      status = serve_profile(server, query, body);
+    else if (strncmp(target, "/tiles/", 7) == 0) {
+      status = serve_tile(server, target, scratch);
+      type = "image/png";
+    } else
+      status = 404;
+  }
+  if (status != 200 || body->failed) {
+    const char *reason = serve_reason(body->failed ? 500 : status);
+    status = body->failed ? 500 : status;
+    body->len = 0;
+    body->failed = 0;
+    buf_put(body, reason, strlen(reason));
+    buf_byte(body, '\n');
+    type = "text/plain";
+  }
+
+  char head[256];
+  int head_len =
+      snprintf(head, sizeof(head),
+               "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+               "Access-Control-Allow-Origin: *\r\nConnection: %s\r\n\r\n",
+               status, serve_reason(status), type, body->len,
+               keep_alive ? "keep-alive" : "close");
+  // The header and body go out together, or a small response would wait
+  // for the client's delayed ACK.
+  if (serve_send(conn->fd, head, (size_t)head_len, MSG_MORE) != 0 ||
+      serve_send(conn->fd, body->data, body->len, 0) != 0)
+    return 0;
+  return keep_alive;
+}
+
+// Length of the request header at the start of conn->req, 0 if incomplete.
+static size_t serve_header_len(struct Conn *conn) {
+  for (size_t i = 3; i < conn->len; i++)
+    if (memcmp(conn->req + i - 3, "\r\n\r\n", 4) == 0)
+      return i + 1;
+  return 0;
+}
+
+static void serve_close(struct Conn *conn) {
+  close(conn->fd);
+  free(conn);
+}
+
+// Wait for more of the next request, the event loop reading it.
+static void serve_rearm(struct Server *server, struct Conn *conn) {
+  struct epoll_event ev = {EPOLLIN | EPOLLONESHOT, {.ptr = conn}};
+  if (epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == -1)
+    serve_close(conn);
+}
+
+// Workers answer requests of queued connections, including any pipelined
+// behind the first, then hand the connection back to the event loop.
+static void *serve_worker(void *arg) {
+  struct Server *server = arg;
+  struct ServeScratch scratch = {{NULL, 0, 0, 0}, NULL, NULL};
+  for (;;) {
+    pthread_mutex_lock(&server->lock);
+    while (server->head == NULL && !server->stop)
+      pthread_cond_wait(&server->ready, &server->lock);
+    struct Conn *conn = server->head;
+    if (conn != NULL && (server->head = conn->next) == NULL)
+      server->tail = NULL;
+    pthread_mutex_unlock(&server->lock);
+    if (conn == NULL)
+      break;
+
+    size_t header_len;
+    int open = 1;
+    while (open && (header_len = serve_header_len(conn)) > 0) {
+      open = serve_request(server, conn, header_len, &scratch);
+      conn->len -= header_len;
+      memmove(conn->req, conn->req + header_len, conn->len);
+    }
+    if (open)
+      serve_rearm(server, conn);
+    else
+      serve_close(conn);
+  }
+  free(scratch.body.data);
+  free(scratch.tile);
+  free(scratch.row);
+  return NULL;
+}
+
+static void serve_enqueue(struct Server *server, struct Conn *conn) {
+  conn->next = NULL;
+  pthread_mutex_lock(&server->lock);
+  *(server->tail ? &server->tail->next : &server->head) = conn;
+  server->tail = conn;
+  pthread_cond_signal(&server->ready);
+  pthread_mutex_unlock(&server->lock);
+}
+
+// Read what a client sent. Once a whole request header is in, the
+// connection goes to the workers; until then it waits for more.
+static void serve_read(struct Server *server, struct Conn *conn) {
+  for (;;) {
+    ssize_t n = recv(conn->fd, conn->req + conn->len,
+                     SERVE_REQUEST_MAX - conn->len, 0);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (n <= 0) {
+      serve_close(conn);
+      return;
+    }
+    conn->len += (size_t)n;
+    if (serve_header_len(conn) > 0) {
+      serve_enqueue(server, conn);
+      return;
+    }
+    if (conn->len == SERVE_REQUEST_MAX) {
+      // Too large to be a request this server answers.
+      serve_close(conn);
+      return;
+    }
   }
+  serve_rearm(server, conn);
+}
 
-  // Convert data to rgb.
-  uint8_t r, g, b;
-  size_t idx = 0;
-  size_t image_idx = 0;
-  for (size_t y = miny; y < maxy; y++) {
-    for (size_t x = minx; x < maxx; x++) {
-      idx = y * GLOBE_COLS + x;
-      if (globe_data[idx] == NO_DATA) {
-        r = 30;
-        g = 40;
-        b = 80;
+// Accept connections and read requests until SIGINT or SIGTERM, then stop
+// the workers.
+static void *serve_loop(void *arg) {
+  struct Server *server = arg;
+  struct epoll_event events[SERVE_MAX_EVENTS];
+  for (int running = 1; running;) {
+    int n = epoll_wait(server->epoll_fd, events, SERVE_MAX_EVENTS, -1);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1) {
+      perror("epoll_wait");
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.ptr == &server->signal_fd) {
+        running = 0;
+      } else if (events[i].data.ptr == &server->listen_fd) {
+        int fd;
+        while ((fd = accept(server->listen_fd, NULL, NULL)) != -1) {
+          struct Conn *conn = malloc(sizeof(*conn));
+          struct epoll_event ev = {EPOLLIN | EPOLLONESHOT, {.ptr = conn}};
+          if (conn == NULL || fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+              fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+            free(conn);
+            close(fd);
+            continue;
+          }
+          conn->fd = fd;
+          conn->len = 0;
+          if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+            serve_close(conn);
+        }
       } else {
-        elev_to_rgb(globe_data[idx], &r, &g, &b, TERRAIN);
+        serve_read(server, events[i].data.ptr);
       }
-      image[image_idx + 0] = r;
-      image[image_idx + 1] = g;
-      image[image_idx + 2] = b;
-      image_idx += channels;
     }
   }
 
-  // Write the image to a PNG file.
-  if (!stbi_write_png(out_file, width, height, channels, image,
-                      width * channels * sizeof(uint8_t))) {
-    fprintf(stderr, "Failed to write image to file.\n");
-    free(image);
-    free(globe_data);
+  pthread_mutex_lock(&server->lock);
+  server->stop = 1;
+  pthread_cond_broadcast(&server->ready);
+  pthread_mutex_unlock(&server->lock);
+  return NULL;
+}
+
+// Serve elevations, profiles and tiles of in_file over HTTP on localhost,
+// with the globe mapped once for every request. One thread runs the event
+// loop, num_threads workers answer requests.
+static int serve(char *in_file, int port, size_t cache_bytes, int level,
+                 size_t num_threads) {
+  struct Globe globe;
+  if (globe_open(&globe, in_file, MADV_RANDOM) != 0)
     return 1;
+  uint32_t *palette = palette_init(TERRAIN);
+  struct TileCache tiles = {PTHREAD_MUTEX_INITIALIZER, 0, cache_bytes,
+                            NULL, NULL, {0}};
+  struct Server server = {&globe, palette, &tiles, level, -1, -1, -1,
+                          PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                          NULL, NULL, 0};
+  int failed = palette == NULL;
+
+  // Listen on localhost.
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons((uint16_t)port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int on = 1;
+  if (!failed &&
+      ((server.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK |
+                                               SOCK_CLOEXEC,
+                                  0)) == -1 ||
+       setsockopt(server.listen_fd, SOL_SOCKET, SO_REUSEADDR, &on,
+                  sizeof(on)) == -1 ||
+       bind(server.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+       listen(server.listen_fd, SOMAXCONN) == -1)) {
+    perror("listen");
+    failed = 1;
   }
 
-  // Free allocated memory.
-  free(image);
-  free(globe_data);
+  // SIGINT and SIGTERM stop the event loop, which then stops the workers.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  if (!failed && ((errno = pthread_sigmask(SIG_BLOCK, &signals, NULL)) != 0 ||
+                  (server.signal_fd = signalfd(-1, &signals, SFD_CLOEXEC)) ==
+                      -1)) {
+    perror("signalfd");
+    failed = 1;
+  }
 
-  return 0;
+  struct epoll_event listen_ev = {EPOLLIN, {.ptr = &server.listen_fd}};
+  struct epoll_event signal_ev = {EPOLLIN, {.ptr = &server.signal_fd}};
+  if (!failed &&
+      ((server.epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+       epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd,
+                 &listen_ev) == -1 ||
+       epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.signal_fd,
+                 &signal_ev) == -1)) {
+    perror("epoll");
+    failed = 1;
+  }
+
+  pthread_t loop;
+  if (!failed && (errno = pthread_create(&loop, NULL, serve_loop, &server))) {
+    perror("pthread_create");
+    failed = 1;
+  }
+  if (!failed) {
+    printf("Serving %s on http://127.0.0.1:%d\n", in_file, port);
+    fflush(stdout);
+    run_workers(serve_worker, &server, num_threads);
+    pthread_join(loop, NULL);
+  }
+
+  if (server.epoll_fd != -1)
+    close(server.epoll_fd);
+  if (server.signal_fd != -1)
+    close(server.signal_fd);
+  if (server.listen_fd != -1)
+    close(server.listen_fd);
+  tile_cache_free(&tiles);
+  free(palette);
+  globe_close(&globe);
+  return failed;
 }
 
+#ifndef GLOBE_LIBRARY
 int main(int argc, char **argv) {
   int opt;
   char *command = NULL;
@@ -380,6 +6136,32 @@ int main(int argc, char **argv) {
   float minlat = INT16_MIN;
   float maxlon = INT16_MIN;
   float maxlat = INT16_MIN;
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  enum CellAnchor anchor = CELL_CORNER;
+  long row_group_size = PARQUET_ROW_GROUP_SIZE;
+  long min_elev = LONG_MIN;
+  long max_elev = LONG_MAX;
+  enum TableFormat format = TABLE_CSV;
+  int png_level = PNG_LEVEL;
+  long max_zoom = TILES_DEFAULT_ZOOM;
+  size_t out_width = 0;
+  size_t out_height = 0;
+  enum Resampling resample = RESAMPLE_BOX;
+  enum GlobeLayout layout = LAYOUT_ROWS;
+  double lon = NAN;
+  double lat = NAN;
+  char *points = NULL;
+  int binary = 0;
+  long port = SERVE_PORT;
+  long cache_mb = SERVE_CACHE_MB;
+  enum Shading shading = SHADE_NONE;
+  double azimuth = HILLSHADE_AZIMUTH;
+  double altitude = HILLSHADE_ALTITUDE;
+  double z_factor = 1;
+  struct Hillshade shade;
+  enum RasterType dtype = RASTER_FLOAT32;
+  long interval = 0;
+  struct Filter filter;
 
   // Define long options
   static struct option getopt_long_options[] = {
@@ -390,6 +6172,30 @@ int main(int argc, char **argv) {
       {"minlat", required_argument, 0, 'w'},
       {"maxlon", required_argument, 0, 'e'},
       {"maxlat", required_argument, 0, 'r'},
+      {"threads", required_argument, 0, 't'},
+      {"cell-center", no_argument, 0, 'c'},
+      {"row-group-size", required_argument, 0, 'g'},
+      {"min-elev", required_argument, 0, 'n'},
+      {"max-elev", required_argument, 0, 'x'},
+      {"format", required_argument, 0, 'f'},
+      {"png-level", required_argument, 0, 'l'},
+      {"max-zoom", required_argument, 0, 'z'},
+      {"width", required_argument, 0, 'W'},
+      {"height", required_argument, 0, 'H'},
+      {"resample", required_argument, 0, 'R'},
+      {"layout", required_argument, 0, 'L'},
+      {"lon", required_argument, 0, 'X'},
+      {"lat", required_argument, 0, 'Y'},
+      {"points", required_argument, 0, 'P'},
+      {"binary", no_argument, 0, 'B'},
+      {"port", required_argument, 0, 'p'},
+      {"cache-mb", required_argument, 0, 'C'},
+      {"shade", required_argument, 0, 'S'},
+      {"azimuth", required_argument, 0, 'A'},
+      {"altitude", required_argument, 0, 'E'},
+      {"z-factor", required_argument, 0, 'Z'},
+      {"dtype", required_argument, 0, 'D'},
+      {"interval", required_argument, 0, 'I'},
       {0, 0, 0, 0}};
 
   // Parse flags.
@@ -429,6 +6235,158 @@ int main(int argc, char **argv) {
         maxlat = atof(optarg);
       }
       break;
+    case 't':
+      if (optarg && *optarg) {
+        num_threads = atol(optarg);
+      }
+      break;
+    case 'c':
+      anchor = CELL_CENTER;
+      break;
+    case 'g':
+      if (optarg && *optarg) {
+        row_group_size = atol(optarg);
+      }
+      break;
+    case 'n':
+      if (optarg && *optarg) {
+        min_elev = atol(optarg);
+      }
+      break;
+    case 'x':
+      if (optarg && *optarg) {
+        max_elev = atol(optarg);
+      }
+      break;
+    case 'f':
+      if (optarg && strcmp(optarg, "csv") == 0) {
+        format = TABLE_CSV;
+      } else if (optarg && strcmp(optarg, "cells") == 0) {
+        format = TABLE_CELLS;
+      } else if (optarg && strcmp(optarg, "points") == 0) {
+        format = TABLE_POINTS;
+      } else {
+        printf("--format must be one of csv, cells, points.\n");
+        return 1;
+      }
+      break;
+    case 'l':
+      if (optarg && *optarg >= '0' && *optarg <= '9' && optarg[1] == '\0') {
+        png_level = *optarg - '0';
+      } else {
+        printf("--png-level must be between 0 and 9.\n");
+        return 1;
+      }
+      break;
+    case 'z':
+      if (optarg && *optarg) {
+        max_zoom = atol(optarg);
+      }
+      break;
+    case 'W':
+      if (optarg && *optarg) {
+        out_width = strtoul(optarg, NULL, 10);
+      }
+      break;
+    case 'H':
+      if (optarg && *optarg) {
+        out_height = strtoul(optarg, NULL, 10);
+      }
+      break;
+    case 'R':
+      if (optarg && strcmp(optarg, "nearest") == 0) {
+        resample = RESAMPLE_NEAREST;
+      } else if (optarg && strcmp(optarg, "box") == 0) {
+        resample = RESAMPLE_BOX;
+      } else if (optarg && strcmp(optarg, "bilinear") == 0) {
+        resample = RESAMPLE_BILINEAR;
+      } else {
+        printf("--resample must be one of nearest, box, bilinear.\n");
+        return 1;
+      }
+      break;
+    case 'L':
+      if (optarg && strcmp(optarg, "rows") == 0) {
+        layout = LAYOUT_ROWS;
+      } else if (optarg && strcmp(optarg, "tiled") == 0) {
+        layout = LAYOUT_TILED;
+      } else if (optarg && strcmp(optarg, "compressed") == 0) {
+        layout = LAYOUT_COMPRESSED;
+      } else {
+        printf("--layout must be one of rows, tiled, compressed.\n");
+        return 1;
+      }
+      break;
+    case 'X':
+      if (optarg && *optarg) {
+        lon = atof(optarg);
+      }
+      break;
+    case 'Y':
+      if (optarg && *optarg) {
+        lat = atof(optarg);
+      }
+      break;
+    case 'P':
+      if (optarg && *optarg) {
+        points = optarg;
+      }
+      break;
+    case 'B':
+      binary = 1;
+      break;
+    case 'p':
+      if (optarg && *optarg) {
+        port = atol(optarg);
+      }
+      break;
+    case 'C':
+      if (optarg && *optarg) {
+        cache_mb = atol(optarg);
+      }
+      break;
+    case 'S':
+      if (optarg && strcmp(optarg, "none") == 0) {
+        shading = SHADE_NONE;
+      } else if (optarg && strcmp(optarg, "hillshade") == 0) {
+        shading = SHADE_HILLSHADE;
+      } else if (optarg && strcmp(optarg, "blend") == 0) {
+        shading = SHADE_BLEND;
+      } else {
+        printf("--shade must be one of none, hillshade, blend.\n");
+        return 1;
+      }
+      break;
+    case 'A':
+      if (optarg && *optarg) {
+        azimuth = atof(optarg);
+      }
+      break;
+    case 'E':
+      if (optarg && *optarg) {
+        altitude = atof(optarg);
+      }
+      break;
+    case 'Z':
+      if (optarg && *optarg) {
+        z_factor = atof(optarg);
+      }
+      break;
+    case 'D':
+      if (optarg && strcmp(optarg, "float32") == 0) {
+        dtype = RASTER_FLOAT32;
+      } else if (optarg && strcmp(optarg, "uint8") == 0) {
+        dtype = RASTER_UINT8;
+      } else {
+        printf("--dtype must be one of float32, uint8.\n");
+        return 1;
+      }
+      break;
+    case 'I':
+      if (optarg && *optarg) {
+        interval = atol(optarg);
+      }
+      break;
     }
   }
 
@@ -440,26 +6398,148 @@ int main(int argc, char **argv) {
 
   if (strcmp(command, "merge") == 0) {
     if (out) {
-      int merge_result = merge(out);
+      int merge_result =
+          merge(out, layout, num_threads > 0 ? num_threads : 1);
       if (merge_result != 0)
         return merge_result;
     } else {
       printf("globe merge requires -o flag.\n");
       return 1;
     }
+  } else if (strcmp(command, "stats") == 0) {
+    if (in) {
+      int stats_result = stats(in, num_threads > 0 ? num_threads : 1);
+      if (stats_result != 0)
+        return stats_result;
+    } else {
+      printf("globe stats requires -i flag.\n");
+      return 1;
+    }
   } else if (strcmp(command, "table") == 0) {
     if (in && out) {
-      int table_result = table(in, out);
+      if (make_filter(minlon, minlat, maxlon, maxlat, min_elev, max_elev,
+                      &filter) != 0)
+        return 1;
+      int table_result = table(in, out, &filter, format, anchor,
+                               num_threads > 0 ? num_threads : 1);
       if (table_result != 0)
         return table_result;
     } else {
       printf("globe table requires -i, -o flags.\n");
       return 1;
     }
+  } else if (strcmp(command, "parquet") == 0) {
+    if (row_group_size <= 0) {
+      printf("--row-group-size must be a positive number of rows.\n");
+      return 1;
+    }
+    if (in && out) {
+      if (make_filter(minlon, minlat, maxlon, maxlat, min_elev, max_elev,
+                      &filter) != 0)
+        return 1;
+      int parquet_result =
+          parquet(in, out, &filter, anchor, row_group_size);
+      if (parquet_result != 0)
+        return parquet_result;
+    } else {
+      printf("globe parquet requires -i, -o flags.\n");
+      return 1;
+    }
+  } else if (strcmp(command, "overviews") == 0) {
+    if (in) {
+      char path[PATH_MAX];
+      if (out == NULL) {
+        overview_path(in, path, sizeof(path));
+        out = path;
+      }
+      int overviews_result = overviews(in, out);
+      if (overviews_result != 0)
+        return overviews_result;
+    } else {
+      printf("globe overviews requires -i flag.\n");
+      return 1;
+    }
+  } else if (strcmp(command, "tiles") == 0) {
+    if (in && out && max_zoom >= 0 && max_zoom <= TILES_MAX_ZOOM) {
+      int tiles_result = tiles(in, out, (int)max_zoom, png_level,
+                               num_threads > 0 ? num_threads : 1);
+      if (tiles_result != 0)
+        return tiles_result;
+    } else {
+      printf("globe tiles requires -i, -o flags and --max-zoom between 0 "
+             "and %d.\n",
+             TILES_MAX_ZOOM);
+      return 1;
+    }
+  } else if (strcmp(command, "query") == 0) {
+    if (in && isnan(lon) == isnan(lat)) {
+      int query_result = query(in, points, out, lon, lat, resample, binary,
+                               num_threads > 0 ? num_threads : 1);
+      if (query_result != 0)
+        return query_result;
+    } else {
+      printf("globe query requires -i and both or neither of --lon, --lat "
+             "flags.\n");
+      return 1;
+    }
+  } else if (strcmp(command, "serve") == 0) {
+    if (in && port > 0 && port <= 65535 && cache_mb >= 0) {
+      int serve_result =
+          serve(in, (int)port, (size_t)cache_mb << 20, png_level,
+                num_threads > 0 ? num_threads : 1);
+      if (serve_result != 0)
+        return serve_result;
+    } else {
+      printf("globe serve requires -i flag, --port between 1 and 65535.\n");
+      return 1;
+    }
+  } else if (strcmp(command, "slope") == 0 ||
+             strcmp(command, "aspect") == 0) {
+    if (in && out && z_factor > 0) {
+      if (make_filter(minlon, minlat, maxlon, maxlat, LONG_MIN, LONG_MAX,
+                      &filter) != 0)
+        return 1;
+      int surface_result =
+          surface(in, out,
+                  strcmp(command, "slope") == 0 ? SURFACE_SLOPE
+                                                : SURFACE_ASPECT,
+                  filter.win, dtype, z_factor,
+                  num_threads > 0 ? num_threads : 1);
+      if (surface_result != 0)
+        return surface_result;
+    } else {
+      printf("globe %s requires -i, -o flags and a positive --z-factor.\n",
+             command);
+      return 1;
+    }
+  } else if (strcmp(command, "contour") == 0) {
+    if (in && out && interval > 0 && interval <= INT16_MAX) {
+      if (make_filter(minlon, minlat, maxlon, maxlat, min_elev, max_elev,
+                      &filter) != 0)
+        return 1;
+      int contour_result = contour(in, out, &filter, (int)interval, binary,
+                                   num_threads > 0 ? num_threads : 1);
+      if (contour_result != 0)
+        return contour_result;
+    } else {
+      printf("globe contour requires -i, -o flags and --interval between 1 "
+             "and %d.\n",
+             INT16_MAX);
+      return 1;
+    }
   } else if (strcmp(command, "render") == 0) {
+    if (altitude <= 0 || altitude > 90 || !(z_factor > 0)) {
+      printf("--altitude must be in (0, 90] and --z-factor positive.\n");
+      return 1;
+    }
+    hillshade_init(&shade, shading, azimuth, altitude, z_factor);
     if (in && out && minlon > INT16_MIN && minlat > INT16_MIN &&
         maxlon > INT16_MIN && maxlat > INT16_MIN) {
-      int render_result = render(in, out, minlon, minlat, maxlon, maxlat);
+      int render_result =
+          render(in, out, minlon, minlat, maxlon, maxlat, out_width,
+                 out_height, resample,
+                 shading != SHADE_NONE ? &shade : NULL, png_level,
+                 num_threads > 0 ? num_threads : 1);
       if (render_result != 0)
         return render_result;
     } else {
@@ -474,4 +6554,5 @@ int main(int argc, char **argv) {
   }
 
   return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,57 @@
+#ifndef GLOBE_H
+#define GLOBE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Reading globe.bin from other programs. Build libglobe.a with `make lib`
+// and link it with -lm -pthread (and -lz if built with ZLIB=1).
+
+// Layouts of globe.bin. Row-major is the plain 43200x21600 array. Tiled
+// stores 256x256 blocks, each row-major, edge blocks padded with NO_DATA, in
+// row-major block order. Compressed is tiled with each block compressed on
+// its own. The values are stored in the header of the file.
+enum GlobeLayout { LAYOUT_ROWS, LAYOUT_TILED, LAYOUT_COMPRESSED };
+
+// How cells are sampled between output pixels or query points.
+enum Resampling { RESAMPLE_NEAREST, RESAMPLE_BOX, RESAMPLE_BILINEAR };
+
+struct BlockChecks;
+struct BlockCache;
+
+// Read-only view of a globe.bin file. Row-major cells start offset bytes in.
+// For tiled files, index holds the byte offset of each block. Files with a
+// header have a checksum per block. Compressed files also have a cache of
+// decoded blocks.
+struct Globe {
+  int fd;
+  size_t size;
+  const int16_t *data;
+  enum GlobeLayout layout;
+  size_t offset;
+  const uint64_t *index;
+  const uint32_t *checksums;
+  struct BlockChecks *checks;
+  struct BlockCache *cache;
+};
+
+// Map globe.bin. advice is passed to madvise, MADV_RANDOM suits point
+// queries. Returns 1 with a message on stderr if the file can't be read.
+int globe_open(struct Globe *globe, char *in_file, int advice);
+
+void globe_close(struct Globe *globe);
+
+// Elevation at lon/lat, NO_DATA (-500) where there is none. Nearest (and box)
+// take the cell containing the point, bilinear interpolates the centers of
+// the four cells around it that have data. Returns 1 if a block can't be
+// read.
+int globe_query(const struct Globe *globe, double lon, double lat,
+                enum Resampling resample, double *elev);
+
+// Elevations of n points, lonlat holding lon, lat pairs, into elev. Points
+// are looked up in cell order, on num_threads threads.
+int globe_query_batch(const struct Globe *globe, const double *lonlat,
+                      size_t n, enum Resampling resample, double *elev,
+                      size_t num_threads);
+
+#endif
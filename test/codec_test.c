@@ -0,0 +1,106 @@
+// Round trips blocks of different kinds through block_encode and
+// block_decode, and checks that damaged blocks are rejected.
+#define GLOBE_LIBRARY
+#include "globe.c"
+
+#define CELLS (GLOBE_BLOCK * GLOBE_BLOCK)
+#define NUM_KINDS 7
+
+static uint32_t rng = 2463534242u;
+
+// xorshift32, so the blocks are the same on every run.
+uint32_t next_random(void) {
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return rng;
+}
+
+// Fill cells with a kind of block: 0 constant, 1 all NO_DATA, 2 smooth
+// terrain, 3 coast (NO_DATA sea around an island), 4 random, 5 alternating
+// extremes, 6 noisy terrain.
+void make_block(int kind, int16_t *cells) {
+  for (size_t y = 0; y < GLOBE_BLOCK; y++) {
+    for (size_t x = 0; x < GLOBE_BLOCK; x++) {
+      double h = 1200 + 800 * sin(x * 0.031) * cos(y * 0.017) + 3.0 * x;
+      double dx = (double)x - 100;
+      double dy = (double)y - 140;
+      int16_t v;
+      switch (kind) {
+      case 0:
+        v = 37;
+        break;
+      case 1:
+        v = NO_DATA;
+        break;
+      case 2:
+        v = (int16_t)h;
+        break;
+      case 3:
+        v = dx * dx + dy * dy < 60 * 60 ? (int16_t)(h / 4) : NO_DATA;
+        break;
+      case 4:
+        v = (int16_t)next_random();
+        break;
+      case 5:
+        v = (x + y) % 2 ? INT16_MAX : INT16_MIN;
+        break;
+      default:
+        v = (int16_t)(h + next_random() % 64);
+        break;
+      }
+      cells[y * GLOBE_BLOCK + x] = v;
+    }
+  }
+}
+
+int main(void) {
+  static int16_t cells[CELLS];
+  static int16_t decoded[CELLS];
+  static uint8_t encoded[BLOCK_CODEC_MAX + 1];
+  int failed = 0;
+
+  for (int kind = 0; kind < NUM_KINDS; kind++) {
+    make_block(kind, cells);
+    size_t len = block_encode(cells, encoded);
+    if (len == 0 || len > BLOCK_CODEC_MAX) {
+      fprintf(stderr, "block %d: encoded length %zu.\n", kind, len);
+      failed = 1;
+      continue;
+    }
+    memset(decoded, 0, sizeof(decoded));
+    if (block_decode(encoded, len, decoded) != 0 ||
+        memcmp(cells, decoded, sizeof(cells)) != 0) {
+      fprintf(stderr, "block %d: doesn't round trip.\n", kind);
+      failed = 1;
+    }
+
+    // Terrain and constant blocks must shrink, random and extreme ones are
+    // stored.
+    if (kind != 4 && kind != 5 && len >= GLOBE_BLOCK_BYTES / 2) {
+      fprintf(stderr, "block %d: %zu bytes, not compressed.\n", kind, len);
+      failed = 1;
+    }
+    if ((kind == 4 || kind == 5) &&
+        (len != 1 + GLOBE_BLOCK_BYTES || encoded[0] != CODEC_RAW)) {
+      fprintf(stderr, "block %d: not stored raw.\n", kind);
+      failed = 1;
+    }
+
+    // Truncated, padded or mislabeled blocks are malformed.
+    encoded[len] = 0;
+    if (block_decode(encoded, len - 1, decoded) == 0 ||
+        block_decode(encoded, len + 1, decoded) == 0 ||
+        block_decode(encoded, 0, decoded) == 0) {
+      fprintf(stderr, "block %d: bad length accepted.\n", kind);
+      failed = 1;
+    }
+    encoded[0] = encoded[0] == CODEC_RAW ? CODEC_PACKED : CODEC_RAW;
+    if (block_decode(encoded, len, decoded) == 0 &&
+        memcmp(cells, decoded, sizeof(cells)) == 0) {
+      fprintf(stderr, "block %d: bad codec accepted.\n", kind);
+      failed = 1;
+    }
+  }
+  return failed;
+}
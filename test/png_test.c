@@ -0,0 +1,166 @@
+// Encodes images with png_encode at each level and thread count, then reads
+// them back with zlib: the chunks and their CRCs, the zlib stream and its
+// Adler-32, and the unfiltered rows, which must equal the source image.
+#define GLOBE_LIBRARY
+#include "globe.c"
+
+#include <zlib.h>
+
+// Pixel (x, y): smooth gradients, flat areas and noise, so the encoder
+// picks different filters and finds both matches and literals.
+uint8_t test_pixel(size_t x, size_t y, size_t c) {
+  uint32_t h = (uint32_t)(x * 73856093u) ^ (uint32_t)(y * 19349663u);
+  h = (h ^ (h >> 13)) * 0x5bd1e995u;
+  if (y % 97 < 30)
+    return (uint8_t)(x / 7 + y + c * 40);
+  if (x % 211 < 50)
+    return (uint8_t)(c * 90);
+  return (uint8_t)(h >> (8 * c));
+}
+
+int test_rows(void *src, size_t y0, size_t y1, uint8_t *rgb) {
+  size_t width = *(const size_t *)src;
+  for (size_t y = y0; y < y1; y++)
+    for (size_t x = 0; x < width; x++)
+      for (size_t c = 0; c < 3; c++)
+        *rgb++ = test_pixel(x, y, c);
+  return 0;
+}
+
+// Undo the filter of one row of len bytes in place, prev being the
+// unfiltered row above or NULL.
+int unfilter(int type, uint8_t *row, const uint8_t *prev, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    int a = i >= 3 ? row[i - 3] : 0;
+    int b = prev != NULL ? prev[i] : 0;
+    int c = prev != NULL && i >= 3 ? prev[i - 3] : 0;
+    switch (type) {
+    case 0:
+      break;
+    case 1:
+      row[i] = (uint8_t)(row[i] + a);
+      break;
+    case 2:
+      row[i] = (uint8_t)(row[i] + b);
+      break;
+    case 3:
+      row[i] = (uint8_t)(row[i] + (a + b) / 2);
+      break;
+    case 4:
+      row[i] = (uint8_t)(row[i] + paeth(a, b, c));
+      break;
+    default:
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Check that png is a width by height image of test_pixel.
+int check_png(const struct Buf *png, size_t width, size_t height) {
+  static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+  if (png->len < 8 || memcmp(png->data, signature, 8) != 0) {
+    fprintf(stderr, "bad signature.\n");
+    return 1;
+  }
+
+  // Chunks, collecting the IDAT data.
+  struct Buf idat = {0};
+  int seen_end = 0;
+  size_t pos = 8;
+  while (pos + 12 <= png->len && !seen_end) {
+    const uint8_t *p = png->data + pos;
+    size_t len = (size_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    if (pos + 12 + len > png->len)
+      break;
+    const uint8_t *crc = p + 8 + len;
+    uint32_t expected = (uint32_t)crc[0] << 24 | crc[1] << 16 | crc[2] << 8 |
+                        crc[3];
+    if (crc32(0, p + 4, (uInt)(4 + len)) != expected) {
+      fprintf(stderr, "bad CRC on %.4s chunk.\n", (const char *)p + 4);
+      free(idat.data);
+      return 1;
+    }
+    if (memcmp(p + 4, "IHDR", 4) == 0) {
+      uint8_t ihdr[13] = {0, 0, 0, 0, 0, 0, 0, 0, 8, 2, 0, 0, 0};
+      put_be32(ihdr, (uint32_t)width);
+      put_be32(ihdr + 4, (uint32_t)height);
+      if (len != 13 || memcmp(p + 8, ihdr, 13) != 0) {
+        fprintf(stderr, "bad IHDR.\n");
+        free(idat.data);
+        return 1;
+      }
+    } else if (memcmp(p + 4, "IDAT", 4) == 0) {
+      buf_put(&idat, p + 8, len);
+    } else if (memcmp(p + 4, "IEND", 4) == 0) {
+      seen_end = 1;
+    }
+    pos += 12 + len;
+  }
+  if (!seen_end || pos != png->len || idat.failed) {
+    fprintf(stderr, "bad chunks.\n");
+    free(idat.data);
+    return 1;
+  }
+
+  // Inflate, which checks the Adler-32, and unfilter.
+  size_t stride = width * 3 + 1;
+  uLongf raw_len = (uLongf)(stride * height);
+  uint8_t *raw = malloc(raw_len + 1);
+  int failed = raw == NULL ||
+               uncompress(raw, &raw_len, idat.data, (uLong)idat.len) != Z_OK ||
+               raw_len != stride * height;
+  free(idat.data);
+  if (failed) {
+    fprintf(stderr, "bad zlib stream.\n");
+    free(raw);
+    return 1;
+  }
+  for (size_t y = 0; y < height && !failed; y++) {
+    uint8_t *row = raw + y * stride;
+    failed = unfilter(row[0], row + 1, y ? row + 1 - stride : NULL,
+                      stride - 1) != 0;
+    for (size_t i = 0; i + 1 < stride && !failed; i++)
+      failed = row[1 + i] != test_pixel(i / 3, y, i % 3);
+    if (failed)
+      fprintf(stderr, "row %zu differs.\n", y);
+  }
+  free(raw);
+  return failed;
+}
+
+int main(void) {
+  // Several strips, one row, and a single pixel.
+  static const size_t sizes[][2] = {{1500, 700}, {3000, 1}, {1, 1}};
+  static const int levels[] = {0, 1, 6, 9};
+  int failed = 0;
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    size_t width = sizes[s][0];
+    size_t height = sizes[s][1];
+    for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+      struct Buf one = {0};
+      struct Buf four = {0};
+      if (png_encode(-1, &one, test_rows, &width, width, height, levels[l],
+                     1) != 0 ||
+          png_encode(-1, &four, test_rows, &width, width, height, levels[l],
+                     4) != 0) {
+        fprintf(stderr, "%zux%zu level %d: encoding failed.\n", width, height,
+                levels[l]);
+        failed = 1;
+      } else if (check_png(&one, width, height) != 0) {
+        fprintf(stderr, "%zux%zu level %d: doesn't round trip.\n", width,
+                height, levels[l]);
+        failed = 1;
+      } else if (one.len != four.len ||
+                 memcmp(one.data, four.data, one.len) != 0) {
+        fprintf(stderr, "%zux%zu level %d: depends on the thread count.\n",
+                width, height, levels[l]);
+        failed = 1;
+      }
+      free(one.data);
+      free(four.data);
+    }
+  }
+  return failed;
+}
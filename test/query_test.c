@@ -0,0 +1,135 @@
+// Queries a sparse row-major globe.bin with a few known cells through
+// libglobe.a, using only globe.h: nearest and bilinear lookups, the
+// antimeridian, cells without data, and batches against single queries.
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "globe.h"
+
+#define COLS 43200
+#define ROWS 21600
+#define NO_DATA -500
+#define NUM_POINTS 10000
+
+// Set cell (x, y) of the file open on fd.
+static int put_cell(int fd, size_t x, size_t y, int16_t value) {
+  off_t offset = (off_t)((y * COLS + x) * sizeof(int16_t));
+  return pwrite(fd, &value, sizeof(value), offset) != sizeof(value);
+}
+
+static double cell_lon(double x) { return x / COLS * 360 - 180; }
+
+static double cell_lat(double y) { return 90 - y / ROWS * 180; }
+
+// Query lon/lat and compare to expected.
+static int check(const struct Globe *globe, double lon, double lat,
+                 enum Resampling resample, double expected) {
+  double elev;
+  if (globe_query(globe, lon, lat, resample, &elev) != 0) {
+    fprintf(stderr, "%.6f,%.6f: query failed.\n", lon, lat);
+    return 1;
+  }
+  if (fabs(elev - expected) > 1e-3) {
+    fprintf(stderr, "%.6f,%.6f: expected %g, found %g.\n", lon, lat, expected,
+            elev);
+    return 1;
+  }
+  return 0;
+}
+
+int main(void) {
+  char path[] = "query_test_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    perror("mkstemp");
+    return 1;
+  }
+
+  // A legacy file of zeros with a 2x2 patch, one with a cell without data,
+  // and one across the antimeridian.
+  int failed =
+      ftruncate(fd, (off_t)COLS * ROWS * sizeof(int16_t)) != 0 ||
+      put_cell(fd, 100, 200, 1000) || put_cell(fd, 101, 200, 2000) ||
+      put_cell(fd, 100, 201, 3000) || put_cell(fd, 101, 201, 4000) ||
+      put_cell(fd, 500, 600, 100) || put_cell(fd, 501, 600, 200) ||
+      put_cell(fd, 500, 601, 300) || put_cell(fd, 501, 601, NO_DATA) ||
+      put_cell(fd, COLS - 1, 300, 10) || put_cell(fd, 0, 300, 20) ||
+      put_cell(fd, COLS - 1, 301, 30) || put_cell(fd, 0, 301, 40);
+  close(fd);
+  struct Globe globe;
+  if (failed || globe_open(&globe, path, MADV_RANDOM) != 0) {
+    perror("query_test");
+    unlink(path);
+    return 1;
+  }
+  unlink(path);
+
+  // Cell centers, and points between them.
+  failed |= check(&globe, cell_lon(100.5), cell_lat(200.5), RESAMPLE_NEAREST,
+                  1000);
+  failed |= check(&globe, cell_lon(101.9), cell_lat(201.1), RESAMPLE_NEAREST,
+                  4000);
+  failed |= check(&globe, cell_lon(100.5), cell_lat(200.5), RESAMPLE_BILINEAR,
+                  1000);
+  failed |= check(&globe, cell_lon(101), cell_lat(201), RESAMPLE_BILINEAR,
+                  2500);
+  failed |= check(&globe, cell_lon(100.75), cell_lat(200.5),
+                  RESAMPLE_BILINEAR, 1250);
+
+  // Neighbors without data are left out, a cell without data has none.
+  failed |= check(&globe, cell_lon(500.9), cell_lat(600.9), RESAMPLE_BILINEAR,
+                  (0.36 * 100 + 0.24 * 200 + 0.24 * 300) / 0.84);
+  failed |= check(&globe, cell_lon(501.5), cell_lat(601.5),
+                  RESAMPLE_BILINEAR, NO_DATA);
+  failed |= check(&globe, cell_lon(501.5), cell_lat(601.5), RESAMPLE_NEAREST,
+                  NO_DATA);
+
+  // Both sides of the antimeridian interpolate across it, off the globe
+  // there is no data.
+  failed |= check(&globe, 180, cell_lat(301), RESAMPLE_BILINEAR, 25);
+  failed |= check(&globe, -180, cell_lat(301), RESAMPLE_BILINEAR, 25);
+  failed |= check(&globe, 180, cell_lat(300.5), RESAMPLE_NEAREST, 10);
+  failed |= check(&globe, 180.5, 0, RESAMPLE_NEAREST, NO_DATA);
+  failed |= check(&globe, 0, -91, RESAMPLE_BILINEAR, NO_DATA);
+
+  // Batches, in any order and on several threads, give the same elevations
+  // as single queries. Points cluster around the known cells.
+  double *lonlat = malloc(NUM_POINTS * 2 * sizeof(double));
+  double *elev = malloc(NUM_POINTS * sizeof(double));
+  if (lonlat == NULL || elev == NULL) {
+    perror("query_test malloc");
+    return 1;
+  }
+  srand(1);
+  static const double corners[3][2] = {{99, 199}, {499, 599}, {-2, 299}};
+  for (size_t p = 0; p < NUM_POINTS; p++) {
+    double x = corners[p % 3][0] + 4.0 * rand() / RAND_MAX;
+    double y = corners[p % 3][1] + 4.0 * rand() / RAND_MAX;
+    lonlat[2 * p] = p % 100 == 0 ? x - 190 : cell_lon(x < 0 ? x + COLS : x);
+    lonlat[2 * p + 1] = cell_lat(y);
+  }
+  static const enum Resampling resamplings[2] = {RESAMPLE_NEAREST,
+                                                 RESAMPLE_BILINEAR};
+  for (size_t r = 0; r < 2; r++) {
+    enum Resampling resample = resamplings[r];
+    if (globe_query_batch(&globe, lonlat, NUM_POINTS, resample, elev, 4) !=
+        0) {
+      fprintf(stderr, "batch query failed.\n");
+      failed = 1;
+      continue;
+    }
+    for (size_t p = 0; p < NUM_POINTS; p++)
+      failed |= check(&globe, lonlat[2 * p], lonlat[2 * p + 1], resample,
+                      elev[p]);
+  }
+  free(lonlat);
+  free(elev);
+  globe_close(&globe);
+  return failed;
+}
@@ -0,0 +1,66 @@
+// Checks how serve parses request parameters: percent escapes, truncated
+// ones, and coordinates that aren't finite or are off the globe. None of
+// these requests reach the globe.
+#define GLOBE_LIBRARY
+#include "globe.c"
+
+// Check that serve_param finds name in query as expected, with value.
+int check_param(const char *query, const char *name, int expected,
+                const char *value) {
+  char out[16];
+  int found = serve_param(query, name, out, sizeof(out));
+  if (found != expected || (found == 1 && strcmp(out, value) != 0)) {
+    fprintf(stderr, "%s: %s is %d, expected %d.\n", query, name, found,
+            expected);
+    return 1;
+  }
+  return 0;
+}
+
+// Check that handler answers query with a 400.
+int check_rejected(int (*handler)(struct Server *, const char *, struct Buf *),
+                   const char *query) {
+  // Copied to the heap so reading past the end shows up under ASan.
+  char *copy = strdup(query);
+  struct Server server = {0};
+  struct Buf body = {0};
+  int status = copy != NULL ? handler(&server, copy, &body) : 0;
+  free(copy);
+  free(body.data);
+  if (status != 400) {
+    fprintf(stderr, "%s: status %d, expected 400.\n", query, status);
+    return 1;
+  }
+  return 0;
+}
+
+int main(void) {
+  int failed = 0;
+
+  // Escapes, and escapes cut short by the end or the next parameter.
+  failed |= check_param("lon=%41%2c+1", "lon", 1, "A, 1");
+  failed |= check_param("lat=1&lon=2", "lon", 1, "2");
+  failed |= check_param("lat=1", "lon", 0, NULL);
+  failed |= check_param("lon=%a", "lon", -1, NULL);
+  failed |= check_param("lon=%", "lon", -1, NULL);
+  failed |= check_param("lon=%a&lat=1", "lon", -1, NULL);
+  failed |= check_param("lon=%a&lat=1", "lat", 1, "1");
+  failed |= check_param("lon=%zz", "lon", -1, NULL);
+  failed |= check_param("lon=12345678901234567890", "lon", -1, NULL);
+
+  failed |= check_rejected(serve_elevation, "lon=%a");
+  failed |= check_rejected(serve_elevation, "lon=%a&lat=1");
+  failed |= check_rejected(serve_elevation, "lon=1&lat=2&resample=%6");
+  failed |= check_rejected(serve_profile, "path=1,2,3,4&samples=1%");
+
+  // Coordinates that aren't finite, or are off the globe.
+  failed |= check_rejected(serve_elevation, "lon=inf&lat=0");
+  failed |= check_rejected(serve_elevation, "lon=0&lat=nan");
+  failed |= check_rejected(serve_elevation, "lon=180.5&lat=0");
+  failed |= check_rejected(serve_elevation, "lon=0&lat=-91");
+  failed |= check_rejected(serve_profile, "path=inf,0,0,0");
+  failed |= check_rejected(serve_profile, "path=0,0,0,1e999");
+  failed |= check_rejected(serve_profile, "path=0,0,10,95");
+  failed |= check_rejected(serve_profile, "path=-181,0,10,0");
+  return failed;
+}